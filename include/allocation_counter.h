@@ -0,0 +1,13 @@
+#ifndef ALLOCATION_COUNTER_H
+#define ALLOCATION_COUNTER_H
+
+#include <cstddef>
+
+using namespace std;
+
+class AllocationCounter {
+public:
+    static size_t count();
+};
+
+#endif
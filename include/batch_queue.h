@@ -0,0 +1,39 @@
+#ifndef BATCH_QUEUE_H
+#define BATCH_QUEUE_H
+
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+using namespace std;
+
+struct TrainingBatch {
+    int epoch = 0;
+    int index = 0;
+    bool lastInEpoch = false;
+    int contextLength = 0;
+    int size = 0;
+    vector<int> contexts;
+    vector<int> targets;
+    vector<int> targetOffsets;
+    vector<double> weights;
+};
+
+class BatchQueue {
+public:
+    explicit BatchQueue(size_t capacity);
+    ~BatchQueue();
+
+    BatchQueue(const BatchQueue&) = delete;
+    BatchQueue& operator=(const BatchQueue&) = delete;
+
+    bool push(TrainingBatch* batch);
+    bool pop(TrainingBatch*& batch);
+
+private:
+    vector<TrainingBatch*> slots;
+    alignas(64) atomic<size_t> head;
+    alignas(64) atomic<size_t> tail;
+};
+
+#endif
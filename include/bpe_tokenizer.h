@@ -0,0 +1,39 @@
+#ifndef BPE_TOKENIZER_H
+#define BPE_TOKENIZER_H
+
+#include "tokenizer.h"
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+using namespace std;
+
+class BpeTokenizer : public Tokenizer {
+public:
+    explicit BpeTokenizer(int targetVocabSize = 8000);
+    ~BpeTokenizer() override;
+
+    void buildVocabulary(const vector<string>& texts) override;
+    vector<int> tokenize(const string& text) override;
+    string detokenize(const vector<int>& tokens) override;
+    string getTokenText(int tokenId, bool startOfText) const override;
+    TokenizerKind getKind() const override;
+    void saveVocabulary(ostream& out) const override;
+    bool loadVocabulary(istream& in) override;
+
+private:
+    int targetVocabSize;
+    int firstByteId;
+    unordered_map<uint64_t, int> mergedIds;
+    unordered_map<string, vector<int>> chunkCache;
+    mutex chunkCacheMutex;
+
+    static uint64_t pairKey(int left, int right);
+    vector<string> splitChunks(const string& text) const;
+    void encodeChunk(const string& chunk, vector<int>& tokens);
+    int addToken(const string& token);
+};
+
+#endif
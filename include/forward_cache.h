@@ -0,0 +1,58 @@
+#ifndef FORWARD_CACHE_H
+#define FORWARD_CACHE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+using namespace std;
+
+class ForwardCache {
+public:
+    explicit ForwardCache(size_t capacity = 4096, int contextLength = 32, int maxCandidates = 64);
+    ~ForwardCache();
+
+    ForwardCache(const ForwardCache&) = delete;
+    ForwardCache& operator=(const ForwardCache&) = delete;
+
+    bool lookup(uint64_t key, const int* context, int count, vector<pair<double, int>>& candidates);
+    void insert(uint64_t key, const int* context, int count, const vector<pair<double, int>>& candidates);
+    void clear();
+
+    int getMaxCandidates() const;
+    size_t size() const;
+    size_t getHits() const;
+    size_t getMisses() const;
+    size_t getEvictions() const;
+    double getHitRate() const;
+
+private:
+    struct Entry {
+        uint64_t key = 0;
+        int previous = -1;
+        int next = -1;
+        vector<int> context;
+        vector<pair<double, int>> candidates;
+    };
+
+    int maxCandidates;
+    mutable mutex cacheMutex;
+    vector<Entry> entries;
+    vector<int> table;
+    size_t tableMask;
+    int used;
+    int head;
+    int tail;
+    size_t hits;
+    size_t misses;
+    size_t evictions;
+
+    size_t homePosition(uint64_t key) const;
+    int findPosition(uint64_t key) const;
+    void erasePosition(size_t position);
+    void unlink(int slot);
+    void pushFront(int slot);
+};
+
+#endif
@@ -3,27 +3,64 @@
 
 #include "neural_network.h"
 #include "tokenizer.h"
+#include "sentence_index.h"
+#include "forward_cache.h"
+#include <cstdint>
 #include <string>
 #include <vector>
+#include <random>
+#include <functional>
 
 using namespace std;
 
 class Inference {
 public:
-    Inference(NeuralNetwork* network, Tokenizer* tokenizer);
+    Inference(const NeuralNetwork* network, Tokenizer* tokenizer);
     ~Inference();
 
     string generateResponse(const string& question, int maxTokens = 100);
     string generateText(const string& prompt, int maxTokens = 50);
+    string generateResponseStream(const string& question, int maxTokens, const function<bool(const string&)>& onText);
+    string generateTextStream(const string& prompt, int maxTokens, const function<bool(const string&)>& onText);
     double calculateSimilarity(const string& text1, const string& text2);
+    void setSentenceIndex(const SentenceIndex* index);
+    void setForwardCache(ForwardCache* cache);
 
 private:
-    NeuralNetwork* neuralNetwork;
+    const NeuralNetwork* neuralNetwork;
     Tokenizer* tokenizer;
-    int contextLength;
+    const SentenceIndex* sentenceIndex;
+    ForwardCache* forwardCache;
 
-    vector<int> generateNextTokens(const vector<int>& context, int numTokens);
-    int sampleFromProbabilities(const Eigen::VectorXd& probabilities);
+    class ContextWindow {
+    public:
+        explicit ContextWindow(int capacity);
+
+        void push(int token);
+        const int* data() const;
+        int size() const;
+        uint64_t hash() const;
+
+    private:
+        vector<int> buffer;
+        int capacity;
+        int start;
+        int count;
+        uint64_t rollingHash;
+        uint64_t leadingPower;
+    };
+
+    struct SamplerState {
+        mt19937 generator;
+        Eigen::VectorXd adjustedProbs;
+        vector<pair<double, int>> probIndexPairs;
+    };
+
+    vector<int> generateNextTokens(const vector<int>& context, int numTokens,
+                                   const function<bool(int)>& onToken = nullptr);
+    int sampleFromProbabilities(const Eigen::VectorXd& probabilities, SamplerState& sampler);
+    void selectCandidates(const Eigen::VectorXd& probabilities, SamplerState& sampler);
+    int sampleCandidate(SamplerState& sampler);
 };
 
 #endif
\ No newline at end of file
@@ -1,49 +1,106 @@
 #ifndef NEURAL_NETWORK_H
 #define NEURAL_NETWORK_H
 
+#include <cstdint>
 #include <vector>
 #include <memory>
+#include <random>
 #include <Eigen/Dense>
 
 using namespace std;
 
+enum class ContextEncoder {
+    Concatenated,
+    PositionWeightedBag
+};
+
 class NeuralNetwork {
 public:
-    NeuralNetwork(int vocabSize, int embeddingDim, int hiddenDim, int contextLength);
+    struct ForwardState {
+        vector<int> inputTokens;
+        Eigen::VectorXd embeddings;
+        Eigen::VectorXd hiddenActivations;
+        Eigen::VectorXd output;
+    };
+
+    struct Checkpoint {
+        int vocabSize = 0;
+        Eigen::MatrixXd embeddingMatrix;
+        Eigen::MatrixXd hiddenWeights;
+        Eigen::VectorXd hiddenBias;
+        Eigen::MatrixXd outputWeights;
+        Eigen::VectorXd outputBias;
+        Eigen::MatrixXd positionWeights;
+    };
+
+    NeuralNetwork(int vocabSize, int embeddingDim, int hiddenDim, int contextLength,
+                  ContextEncoder contextEncoder = ContextEncoder::Concatenated);
     ~NeuralNetwork();
 
-    Eigen::VectorXd forward(const vector<int>& inputTokens);
-    void backward(const Eigen::VectorXd& prediction, const vector<int>& target);
+    Eigen::VectorXd forward(const vector<int>& inputTokens, ForwardState& state) const;
+    const Eigen::VectorXd& forward(const int* inputTokens, int count, ForwardState& state) const;
+    const Eigen::VectorXd& forwardLogits(const int* inputTokens, int count, ForwardState& state) const;
+    void prepareState(ForwardState& state) const;
+    double crossEntropyLoss(const ForwardState& state, const vector<int>& target) const;
+    double softmaxCrossEntropy(ForwardState& state, const vector<int>& target, double weight = 1.0) const;
+    void backward(const ForwardState& state);
     void updateWeights(double learningRate);
+    void backwardAndUpdate(const ForwardState& state, double learningRate);
+
+    void setFusedUpdates(bool enabled);
+    bool usesFusedUpdates() const;
+
+    void growVocabulary(int newVocabSize);
+    int getVocabSize() const;
+    int getEmbeddingDim() const;
+    int getContextLength() const;
+    ContextEncoder getContextEncoder() const;
+    Eigen::VectorXd pooledEmbedding(const vector<int>& tokens) const;
+    uint64_t getFingerprint() const;
+
+    Checkpoint createCheckpoint() const;
+    void restoreCheckpoint(const Checkpoint& checkpoint);
 
     void saveModel(const string& filename);
     void loadModel(const string& filename);
 
 private:
     int vocabSize;
+    int vocabCapacity;
     int embeddingDim;
     int hiddenDim;
     int contextLength;
+    ContextEncoder contextEncoder;
 
     Eigen::MatrixXd embeddingMatrix;
     Eigen::MatrixXd hiddenWeights;
     Eigen::VectorXd hiddenBias;
     Eigen::MatrixXd outputWeights;
     Eigen::VectorXd outputBias;
+    Eigen::MatrixXd positionWeights;
 
     Eigen::MatrixXd embeddingGradients;
     Eigen::MatrixXd hiddenWeightsGradients;
     Eigen::VectorXd hiddenBiasGradients;
     Eigen::MatrixXd outputWeightsGradients;
     Eigen::VectorXd outputBiasGradients;
-
-    Eigen::VectorXd embeddings;
-    Eigen::VectorXd hiddenActivations;
+    Eigen::MatrixXd positionWeightsGradients;
+    int hiddenGradientRows;
+    int positionGradientColumns;
+    bool fusedUpdates;
 
     void initializeWeights();
-    Eigen::VectorXd softmax(const Eigen::VectorXd& input);
-    Eigen::VectorXd relu(const Eigen::VectorXd& input);
-    Eigen::VectorXd reluDerivative(const Eigen::VectorXd& input);
+    void initializeVocabularyRows(int first, int last, mt19937& gen);
+    void allocateGradients();
+    int inputRows() const;
+    int encodedRows(int actualContextLength) const;
+    void encodeContext(ForwardState& state) const;
+    void accumulateContextGradients(const ForwardState& state, const Eigen::VectorXd& inputError);
+    void applyContextUpdates(const ForwardState& state, const Eigen::VectorXd& inputError, double learningRate);
+    void softmaxInPlace(Eigen::VectorXd& values) const;
+    double expInPlace(Eigen::VectorXd& values, double shift) const;
+    double targetLogitMean(const Eigen::VectorXd& logits, const vector<int>& target) const;
+    Eigen::VectorXd reluDerivative(const Eigen::VectorXd& input) const;
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,52 @@
+#ifndef SENTENCE_INDEX_H
+#define SENTENCE_INDEX_H
+
+#include "neural_network.h"
+#include "tokenizer.h"
+#include <string>
+#include <vector>
+#include <Eigen/Dense>
+
+using namespace std;
+
+class SentenceIndex {
+public:
+    SentenceIndex(const NeuralNetwork* network, Tokenizer* tokenizer);
+    ~SentenceIndex();
+
+    void build(const vector<string>& sentences);
+    void add(const vector<string>& newSentences);
+    void refresh();
+    void clear();
+    void buildCoarseQuantizer(int numLists, int iterations = 10);
+    vector<pair<int, float>> search(const string& query, int k, int numProbes = 8) const;
+    vector<pair<int, float>> search(const Eigen::VectorXf& query, int k, int numProbes = 8) const;
+    Eigen::VectorXf embed(const string& text) const;
+
+    const string& getSentence(int id) const;
+    int size() const;
+
+    void saveIndex(const string& filename) const;
+    void loadIndex(const string& filename);
+
+private:
+    const NeuralNetwork* neuralNetwork;
+    Tokenizer* tokenizer;
+    int dim;
+
+    vector<string> sentences;
+    vector<float> vectors;
+    vector<float> centroids;
+    vector<vector<int>> lists;
+    int clusteredSize;
+    uint64_t modelFingerprint;
+
+    typedef Eigen::Matrix<float, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> RowMatrixXf;
+    Eigen::Map<const RowMatrixXf> vectorMatrix() const;
+    Eigen::Map<const RowMatrixXf> centroidMatrix() const;
+    void assignToCentroids(int first, int last, vector<int>& assignment) const;
+    uint64_t currentFingerprint() const;
+    vector<pair<int, float>> selectTopK(vector<pair<int, float>>& scored, int k) const;
+};
+
+#endif
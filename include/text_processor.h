@@ -17,12 +17,12 @@ public:
     vector<string> preprocessText(const string& text);
     string getRawText() const;
     void clearText();
+    vector<string> splitIntoSentences(const string& text);
 
 private:
     string rawText;
     string toLowerCase(const string& text);
     string removePunctuation(const string& text);
-    vector<string> splitIntoSentences(const string& text);
 };
 
 #endif
\ No newline at end of file
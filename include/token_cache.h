@@ -0,0 +1,53 @@
+#ifndef TOKEN_CACHE_H
+#define TOKEN_CACHE_H
+
+#include "tokenizer.h"
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+class TokenCache {
+public:
+    TokenCache();
+    ~TokenCache();
+
+    TokenCache(const TokenCache&) = delete;
+    TokenCache& operator=(const TokenCache&) = delete;
+
+    static bool build(const string& filename, const vector<string>& texts, Tokenizer* tokenizer);
+
+    bool open(const string& filename);
+    void close();
+    bool isOpen() const;
+
+    uint64_t getFingerprint() const;
+    TokenizerKind getTokenizerKind() const;
+    bool loadTokenizer(Tokenizer* tokenizer) const;
+    int getDocumentCount() const;
+    size_t getTokenCount() const;
+    vector<int> getDocument(int index) const;
+
+private:
+    struct Header {
+        char magic[4];
+        uint32_t version;
+        uint32_t idWidth;
+        uint32_t tokenizerKind;
+        uint64_t fingerprint;
+        uint64_t documentCount;
+        uint64_t tokenCount;
+        uint64_t vocabularyBytes;
+    };
+
+    void* mapping;
+    size_t mappingSize;
+    const Header* header;
+    const uint64_t* offsets;
+    const unsigned char* tokens;
+    const char* vocabulary;
+};
+
+#endif
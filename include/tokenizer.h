@@ -1,29 +1,42 @@
 #ifndef TOKENIZER_H
 #define TOKENIZER_H
 
+#include <cstdint>
+#include <iostream>
 #include <string>
 #include <vector>
 #include <unordered_map>
 
 using namespace std;
 
+enum class TokenizerKind {
+    Word,
+    BytePair
+};
+
 class Tokenizer {
 public:
     Tokenizer();
-    ~Tokenizer();
+    virtual ~Tokenizer();
 
-    void buildVocabulary(const vector<string>& texts);
-    vector<int> tokenize(const string& text);
-    string detokenize(const vector<int>& tokens);
+    virtual void buildVocabulary(const vector<string>& texts);
+    virtual vector<int> tokenize(const string& text);
+    virtual string detokenize(const vector<int>& tokens);
+    virtual string getTokenText(int tokenId, bool startOfText) const;
     int getVocabSize() const;
     int getTokenId(const string& token) const;
     string getToken(int tokenId) const;
+    uint64_t getFingerprint() const;
+    virtual TokenizerKind getKind() const;
+    virtual void saveVocabulary(ostream& out) const;
+    virtual bool loadVocabulary(istream& in);
 
-private:
+protected:
     unordered_map<string, int> vocabToId;
     unordered_map<int, string> idToVocab;
     int nextTokenId;
 
+private:
     vector<string> splitWords(const string& text);
 };
 
@@ -3,27 +3,101 @@
 
 #include "neural_network.h"
 #include "tokenizer.h"
+#include "token_cache.h"
+#include "batch_queue.h"
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <random>
 #include <vector>
 #include <string>
 
 using namespace std;
 
+struct TrainingSample {
+    vector<int> context;
+    vector<int> target;
+    double weight;
+};
+
+struct PipelineStats {
+    int batches = 0;
+    double trainerWaitSeconds = 0.0;
+    double producerWaitSeconds = 0.0;
+};
+
 class Trainer {
 public:
     Trainer(NeuralNetwork* network, Tokenizer* tokenizer);
     ~Trainer();
 
     void trainOnText(const vector<string>& texts, int epochs, double learningRate);
+    void trainOnCorpus(const TokenCache& corpus, int epochs, double learningRate);
     double calculateLoss(const vector<string>& texts);
+    double calculateLoss(const TokenCache& corpus);
     void setContextLength(int length);
+    void setFusedUpdates(bool enabled);
+    void setValidationSplit(double fraction);
+    void setEvaluationInterval(int batches);
+    void setEarlyStopping(int patience);
+    void setDeduplicateSamples(bool enabled);
+    void setMaxSampleWeight(double weight);
+    void setPrefetchThreads(int threads);
+    void setPrefetchDepth(int batches);
+    PipelineStats getPipelineStats() const;
 
 private:
     NeuralNetwork* neuralNetwork;
     Tokenizer* tokenizer;
     int contextLength;
+    NeuralNetwork::ForwardState forwardState;
+
+    double validationSplit;
+    int evaluationInterval;
+    int earlyStoppingPatience;
+    bool deduplicateSamples;
+    double maxSampleWeight;
+    double bestValidationLoss;
+    int evaluationsWithoutImprovement;
+    NeuralNetwork::Checkpoint bestCheckpoint;
+
+    int prefetchThreads;
+    int prefetchDepth;
+    PipelineStats pipelineStats;
+
+    struct PrefetchChannel {
+        explicit PrefetchChannel(int depth);
+
+        BatchQueue ready;
+        BatchQueue free;
+        vector<TrainingBatch> buffers;
+        double waitSeconds;
+    };
+
+    struct EpochPlan {
+        once_flag built;
+        vector<int> order;
+        vector<pair<int, int>> batches;
+        atomic<int> finishedProducers{0};
+    };
 
-    vector<pair<vector<int>, vector<int>>> createTrainingPairs(const vector<string>& texts);
-    void shuffleTrainingData(vector<pair<vector<int>, vector<int>>>& data);
+    void trainOnSamples(vector<TrainingSample>& trainingPairs, int epochs, double learningRate);
+    vector<TrainingSample> createTrainingPairs(const vector<string>& texts);
+    vector<TrainingSample> createTrainingPairs(const TokenCache& corpus);
+    void appendTrainingPairs(const vector<int>& tokens, vector<TrainingSample>& trainingPairs);
+    bool checkCorpus(const TokenCache& corpus) const;
+    void mergeDuplicateSamples(vector<TrainingSample>& samples);
+    void produceBatches(const vector<TrainingSample>& data, vector<unique_ptr<EpochPlan>>& plans, int batchSize,
+                        unsigned seed, int producerIndex, PrefetchChannel& channel, const atomic<bool>& stop) const;
+    int sampleCopies(const TrainingSample& sample) const;
+    void packBatch(const vector<TrainingSample>& data, const int* indices, int count, TrainingBatch& batch) const;
+    TrainingBatch* nextBatch(PrefetchChannel& channel);
+    vector<pair<int, int>> createLengthBatches(const vector<TrainingSample>& data, vector<int>& order, int batchSize,
+                                               mt19937& gen) const;
+    void shuffleTrainingData(vector<TrainingSample>& data);
+    vector<TrainingSample> holdOutValidationData(vector<TrainingSample>& data);
+    double evaluateLoss(const vector<TrainingSample>& data) const;
+    bool recordValidationLoss(double loss);
 };
 
 #endif
\ No newline at end of file
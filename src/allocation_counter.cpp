@@ -0,0 +1,90 @@
+#include "allocation_counter.h"
+#include <algorithm>
+#include <cstdlib>
+#include <new>
+
+using namespace std;
+
+static thread_local size_t allocations = 0;
+
+size_t AllocationCounter::count() {
+    return allocations;
+}
+
+static void* countedAllocate(size_t size) {
+    allocations++;
+    void* memory = malloc(size > 0 ? size : 1);
+    if (memory == nullptr) {
+        throw bad_alloc();
+    }
+    return memory;
+}
+
+static void* countedAllocateAligned(size_t size, align_val_t alignment) {
+    allocations++;
+    size_t align = static_cast<size_t>(alignment);
+    size_t rounded = (max(size, (size_t)1) + align - 1) / align * align;
+    void* memory = aligned_alloc(align, rounded);
+    if (memory == nullptr) {
+        throw bad_alloc();
+    }
+    return memory;
+}
+
+void* operator new(size_t size) {
+    return countedAllocate(size);
+}
+
+void* operator new[](size_t size) {
+    return countedAllocate(size);
+}
+
+void* operator new(size_t size, const nothrow_t&) noexcept {
+    allocations++;
+    return malloc(size > 0 ? size : 1);
+}
+
+void* operator new[](size_t size, const nothrow_t&) noexcept {
+    allocations++;
+    return malloc(size > 0 ? size : 1);
+}
+
+void* operator new(size_t size, align_val_t alignment) {
+    return countedAllocateAligned(size, alignment);
+}
+
+void* operator new[](size_t size, align_val_t alignment) {
+    return countedAllocateAligned(size, alignment);
+}
+
+void operator delete(void* memory) noexcept {
+    free(memory);
+}
+
+void operator delete[](void* memory) noexcept {
+    free(memory);
+}
+
+void operator delete(void* memory, size_t) noexcept {
+    free(memory);
+}
+
+void operator delete[](void* memory, size_t) noexcept {
+    free(memory);
+}
+
+void operator delete(void* memory, align_val_t) noexcept {
+    free(memory);
+}
+
+void operator delete[](void* memory, align_val_t) noexcept {
+    free(memory);
+}
+
+void operator delete(void* memory, size_t, align_val_t) noexcept {
+    free(memory);
+}
+
+void operator delete[](void* memory, size_t, align_val_t) noexcept {
+    free(memory);
+}
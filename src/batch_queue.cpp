@@ -0,0 +1,33 @@
+#include "batch_queue.h"
+#include <algorithm>
+
+using namespace std;
+
+BatchQueue::BatchQueue(size_t capacity)
+    : slots(max(capacity, (size_t)1), nullptr), head(0), tail(0) {
+}
+
+BatchQueue::~BatchQueue() {
+}
+
+bool BatchQueue::push(TrainingBatch* batch) {
+    size_t currentTail = tail.load(memory_order_relaxed);
+    if (currentTail - head.load(memory_order_acquire) == slots.size()) {
+        return false;
+    }
+
+    slots[currentTail % slots.size()] = batch;
+    tail.store(currentTail + 1, memory_order_release);
+    return true;
+}
+
+bool BatchQueue::pop(TrainingBatch*& batch) {
+    size_t currentHead = head.load(memory_order_relaxed);
+    if (currentHead == tail.load(memory_order_acquire)) {
+        return false;
+    }
+
+    batch = slots[currentHead % slots.size()];
+    head.store(currentHead + 1, memory_order_release);
+    return true;
+}
@@ -0,0 +1,286 @@
+#include "bpe_tokenizer.h"
+#include <algorithm>
+#include <cctype>
+#include <iostream>
+#include <queue>
+#include <unordered_set>
+
+using namespace std;
+
+BpeTokenizer::BpeTokenizer(int targetVocabSize)
+    : Tokenizer(), targetVocabSize(targetVocabSize), firstByteId(nextTokenId) {
+    for (int byte = 0; byte < 256; byte++) {
+        addToken(string(1, (char)byte));
+    }
+}
+
+BpeTokenizer::~BpeTokenizer() {
+}
+
+void BpeTokenizer::buildVocabulary(const vector<string>& texts) {
+    if (!mergedIds.empty()) {
+        cout << "Subword vocabulary already built with " << getVocabSize() << " tokens." << endl;
+        return;
+    }
+
+    unordered_map<string, long long> chunkCounts;
+    for (const string& text : texts) {
+        for (const string& chunk : splitChunks(text)) {
+            chunkCounts[chunk]++;
+        }
+    }
+
+    vector<vector<int>> words;
+    vector<long long> wordCounts;
+    words.reserve(chunkCounts.size());
+    wordCounts.reserve(chunkCounts.size());
+    for (const auto& pair : chunkCounts) {
+        vector<int> symbols;
+        for (unsigned char c : pair.first) {
+            symbols.push_back(firstByteId + c);
+        }
+        words.push_back(symbols);
+        wordCounts.push_back(pair.second);
+    }
+
+    unordered_map<uint64_t, long long> pairCounts;
+    unordered_map<uint64_t, unordered_set<int>> pairWords;
+    for (int w = 0; w < (int)words.size(); w++) {
+        for (int i = 0; i + 1 < (int)words[w].size(); i++) {
+            uint64_t key = pairKey(words[w][i], words[w][i + 1]);
+            pairCounts[key] += wordCounts[w];
+            pairWords[key].insert(w);
+        }
+    }
+
+    priority_queue<pair<long long, uint64_t>> heap;
+    for (const auto& pair : pairCounts) {
+        heap.emplace(pair.second, pair.first);
+    }
+
+    while (nextTokenId < targetVocabSize && !heap.empty()) {
+        auto top = heap.top();
+        heap.pop();
+
+        auto countIt = pairCounts.find(top.second);
+        if (countIt == pairCounts.end() || countIt->second != top.first) {
+            continue;
+        }
+        if (top.first < 2) {
+            break;
+        }
+
+        uint64_t key = top.second;
+        int left = (int)(key >> 32);
+        int right = (int)(key & 0xffffffffu);
+        int mergedId = addToken(idToVocab[left] + idToVocab[right]);
+        mergedIds[key] = mergedId;
+
+        unordered_set<uint64_t> changedPairs;
+        unordered_set<int> affectedWords = pairWords[key];
+        for (int w : affectedWords) {
+            vector<int>& symbols = words[w];
+            for (int i = 0; i + 1 < (int)symbols.size(); i++) {
+                uint64_t oldKey = pairKey(symbols[i], symbols[i + 1]);
+                pairCounts[oldKey] -= wordCounts[w];
+                changedPairs.insert(oldKey);
+            }
+
+            vector<int> merged;
+            merged.reserve(symbols.size());
+            for (int i = 0; i < (int)symbols.size(); i++) {
+                if (i + 1 < (int)symbols.size() && symbols[i] == left && symbols[i + 1] == right) {
+                    merged.push_back(mergedId);
+                    i++;
+                } else {
+                    merged.push_back(symbols[i]);
+                }
+            }
+            symbols.swap(merged);
+
+            for (int i = 0; i + 1 < (int)symbols.size(); i++) {
+                uint64_t newKey = pairKey(symbols[i], symbols[i + 1]);
+                pairCounts[newKey] += wordCounts[w];
+                pairWords[newKey].insert(w);
+                changedPairs.insert(newKey);
+            }
+        }
+
+        pairCounts.erase(key);
+        pairWords.erase(key);
+        for (uint64_t changed : changedPairs) {
+            auto it = pairCounts.find(changed);
+            if (it == pairCounts.end()) {
+                continue;
+            }
+            if (it->second <= 0) {
+                pairCounts.erase(it);
+                pairWords.erase(changed);
+            } else {
+                heap.emplace(it->second, changed);
+            }
+        }
+    }
+
+    {
+        lock_guard<mutex> lock(chunkCacheMutex);
+        chunkCache.clear();
+    }
+    cout << "Subword vocabulary built with " << getVocabSize() << " tokens (" << mergedIds.size() << " merges)." << endl;
+}
+
+vector<int> BpeTokenizer::tokenize(const string& text) {
+    vector<int> tokens;
+    for (const string& chunk : splitChunks(text)) {
+        encodeChunk(chunk, tokens);
+    }
+    return tokens;
+}
+
+string BpeTokenizer::detokenize(const vector<int>& tokens) {
+    string result;
+    for (int token : tokens) {
+        if (token < firstByteId) {
+            continue;
+        }
+        auto it = idToVocab.find(token);
+        if (it != idToVocab.end()) {
+            result += it->second;
+        }
+    }
+    return result;
+}
+
+string BpeTokenizer::getTokenText(int tokenId, bool startOfText) const {
+    (void)startOfText;
+    if (tokenId < firstByteId) {
+        return "";
+    }
+    auto it = idToVocab.find(tokenId);
+    return it != idToVocab.end() ? it->second : "";
+}
+
+TokenizerKind BpeTokenizer::getKind() const {
+    return TokenizerKind::BytePair;
+}
+
+void BpeTokenizer::saveVocabulary(ostream& out) const {
+    Tokenizer::saveVocabulary(out);
+    out.write(reinterpret_cast<const char*>(&targetVocabSize), sizeof(targetVocabSize));
+    out.write(reinterpret_cast<const char*>(&firstByteId), sizeof(firstByteId));
+
+    int mergeCount = (int)mergedIds.size();
+    out.write(reinterpret_cast<const char*>(&mergeCount), sizeof(mergeCount));
+    for (const auto& merge : mergedIds) {
+        out.write(reinterpret_cast<const char*>(&merge.first), sizeof(merge.first));
+        out.write(reinterpret_cast<const char*>(&merge.second), sizeof(merge.second));
+    }
+}
+
+bool BpeTokenizer::loadVocabulary(istream& in) {
+    if (!Tokenizer::loadVocabulary(in)) {
+        return false;
+    }
+
+    int mergeCount = 0;
+    in.read(reinterpret_cast<char*>(&targetVocabSize), sizeof(targetVocabSize));
+    in.read(reinterpret_cast<char*>(&firstByteId), sizeof(firstByteId));
+    in.read(reinterpret_cast<char*>(&mergeCount), sizeof(mergeCount));
+    if (!in || mergeCount < 0) {
+        return false;
+    }
+
+    mergedIds.clear();
+    for (int i = 0; i < mergeCount; i++) {
+        uint64_t key = 0;
+        int mergedId = 0;
+        in.read(reinterpret_cast<char*>(&key), sizeof(key));
+        in.read(reinterpret_cast<char*>(&mergedId), sizeof(mergedId));
+        mergedIds[key] = mergedId;
+    }
+
+    lock_guard<mutex> lock(chunkCacheMutex);
+    chunkCache.clear();
+    return (bool)in;
+}
+
+uint64_t BpeTokenizer::pairKey(int left, int right) {
+    return ((uint64_t)(uint32_t)left << 32) | (uint32_t)right;
+}
+
+vector<string> BpeTokenizer::splitChunks(const string& text) const {
+    vector<string> chunks;
+    size_t i = 0;
+    while (i < text.size()) {
+        size_t start = i;
+        if (isspace((unsigned char)text[i])) {
+            i++;
+        }
+        while (i < text.size() && !isspace((unsigned char)text[i])) {
+            i++;
+        }
+        chunks.push_back(text.substr(start, i - start));
+    }
+    return chunks;
+}
+
+void BpeTokenizer::encodeChunk(const string& chunk, vector<int>& tokens) {
+    {
+        lock_guard<mutex> lock(chunkCacheMutex);
+        auto cached = chunkCache.find(chunk);
+        if (cached != chunkCache.end()) {
+            tokens.insert(tokens.end(), cached->second.begin(), cached->second.end());
+            return;
+        }
+    }
+
+    vector<int> symbols;
+    symbols.reserve(chunk.size());
+    for (unsigned char c : chunk) {
+        symbols.push_back(firstByteId + c);
+    }
+
+    while (symbols.size() > 1) {
+        int bestId = -1;
+        uint64_t bestKey = 0;
+        for (int i = 0; i + 1 < (int)symbols.size(); i++) {
+            uint64_t key = pairKey(symbols[i], symbols[i + 1]);
+            auto it = mergedIds.find(key);
+            if (it != mergedIds.end() && (bestId < 0 || it->second < bestId)) {
+                bestId = it->second;
+                bestKey = key;
+            }
+        }
+        if (bestId < 0) {
+            break;
+        }
+
+        int left = (int)(bestKey >> 32);
+        int right = (int)(bestKey & 0xffffffffu);
+        int out = 0;
+        for (int i = 0; i < (int)symbols.size(); i++) {
+            if (i + 1 < (int)symbols.size() && symbols[i] == left && symbols[i + 1] == right) {
+                symbols[out++] = bestId;
+                i++;
+            } else {
+                symbols[out++] = symbols[i];
+            }
+        }
+        symbols.resize(out);
+    }
+
+    tokens.insert(tokens.end(), symbols.begin(), symbols.end());
+
+    lock_guard<mutex> lock(chunkCacheMutex);
+    if (chunkCache.size() >= 100000) {
+        chunkCache.clear();
+    }
+    chunkCache.emplace(chunk, move(symbols));
+}
+
+int BpeTokenizer::addToken(const string& token) {
+    int id = nextTokenId++;
+    idToVocab[id] = token;
+    vocabToId.emplace(token, id);
+    return id;
+}
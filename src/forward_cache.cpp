@@ -0,0 +1,177 @@
+#include "forward_cache.h"
+#include <algorithm>
+
+using namespace std;
+
+ForwardCache::ForwardCache(size_t capacity, int contextLength, int maxCandidates)
+    : maxCandidates(max(maxCandidates, 1)), entries(max(capacity, (size_t)1)), used(0), head(-1), tail(-1),
+      hits(0), misses(0), evictions(0) {
+    size_t tableSize = 1;
+    while (tableSize < 2 * entries.size()) {
+        tableSize <<= 1;
+    }
+    table.assign(tableSize, -1);
+    tableMask = tableSize - 1;
+
+    for (Entry& entry : entries) {
+        entry.context.reserve(max(contextLength, 1));
+        entry.candidates.reserve(this->maxCandidates);
+    }
+}
+
+ForwardCache::~ForwardCache() {
+}
+
+bool ForwardCache::lookup(uint64_t key, const int* context, int count, vector<pair<double, int>>& candidates) {
+    lock_guard<mutex> lock(cacheMutex);
+    int position = findPosition(key);
+    if (position < 0) {
+        misses++;
+        return false;
+    }
+
+    int slot = table[position];
+    Entry& entry = entries[slot];
+    if (entry.context.size() != (size_t)count || !equal(context, context + count, entry.context.begin())) {
+        misses++;
+        return false;
+    }
+
+    unlink(slot);
+    pushFront(slot);
+    candidates.assign(entry.candidates.begin(), entry.candidates.end());
+    hits++;
+    return true;
+}
+
+void ForwardCache::insert(uint64_t key, const int* context, int count, const vector<pair<double, int>>& candidates) {
+    lock_guard<mutex> lock(cacheMutex);
+    int slot;
+    int position = findPosition(key);
+    if (position >= 0) {
+        slot = table[position];
+        unlink(slot);
+    } else {
+        if (used < (int)entries.size()) {
+            slot = used++;
+        } else {
+            slot = tail;
+            unlink(slot);
+            erasePosition(findPosition(entries[slot].key));
+            evictions++;
+        }
+
+        size_t probe = homePosition(key);
+        while (table[probe] >= 0) {
+            probe = (probe + 1) & tableMask;
+        }
+        table[probe] = slot;
+    }
+
+    Entry& entry = entries[slot];
+    size_t kept = min(candidates.size(), (size_t)maxCandidates);
+    entry.key = key;
+    entry.context.assign(context, context + count);
+    entry.candidates.assign(candidates.begin(), candidates.begin() + kept);
+    pushFront(slot);
+}
+
+void ForwardCache::clear() {
+    lock_guard<mutex> lock(cacheMutex);
+    fill(table.begin(), table.end(), -1);
+    used = 0;
+    head = -1;
+    tail = -1;
+}
+
+int ForwardCache::getMaxCandidates() const {
+    return maxCandidates;
+}
+
+size_t ForwardCache::size() const {
+    lock_guard<mutex> lock(cacheMutex);
+    return used;
+}
+
+size_t ForwardCache::getHits() const {
+    lock_guard<mutex> lock(cacheMutex);
+    return hits;
+}
+
+size_t ForwardCache::getMisses() const {
+    lock_guard<mutex> lock(cacheMutex);
+    return misses;
+}
+
+size_t ForwardCache::getEvictions() const {
+    lock_guard<mutex> lock(cacheMutex);
+    return evictions;
+}
+
+double ForwardCache::getHitRate() const {
+    lock_guard<mutex> lock(cacheMutex);
+    size_t lookups = hits + misses;
+    return lookups > 0 ? (double)hits / lookups : 0.0;
+}
+
+size_t ForwardCache::homePosition(uint64_t key) const {
+    key ^= key >> 31;
+    key *= 0x9e3779b97f4a7c15ull;
+    return (size_t)(key >> 17) & tableMask;
+}
+
+int ForwardCache::findPosition(uint64_t key) const {
+    size_t probe = homePosition(key);
+    while (table[probe] >= 0) {
+        if (entries[table[probe]].key == key) {
+            return (int)probe;
+        }
+        probe = (probe + 1) & tableMask;
+    }
+    return -1;
+}
+
+void ForwardCache::erasePosition(size_t position) {
+    table[position] = -1;
+    size_t probe = (position + 1) & tableMask;
+    while (table[probe] >= 0) {
+        size_t home = homePosition(entries[table[probe]].key);
+        size_t distanceFromHome = (probe - home) & tableMask;
+        size_t distanceFromHole = (probe - position) & tableMask;
+        if (distanceFromHome >= distanceFromHole) {
+            table[position] = table[probe];
+            table[probe] = -1;
+            position = probe;
+        }
+        probe = (probe + 1) & tableMask;
+    }
+}
+
+void ForwardCache::unlink(int slot) {
+    Entry& entry = entries[slot];
+    if (entry.previous >= 0) {
+        entries[entry.previous].next = entry.next;
+    } else {
+        head = entry.next;
+    }
+    if (entry.next >= 0) {
+        entries[entry.next].previous = entry.previous;
+    } else {
+        tail = entry.previous;
+    }
+    entry.previous = -1;
+    entry.next = -1;
+}
+
+void ForwardCache::pushFront(int slot) {
+    Entry& entry = entries[slot];
+    entry.previous = -1;
+    entry.next = head;
+    if (head >= 0) {
+        entries[head].previous = slot;
+    }
+    head = slot;
+    if (tail < 0) {
+        tail = slot;
+    }
+}
@@ -1,60 +1,106 @@
 #include "inference.h"
+#ifdef LITLM_CHECK_GENERATION_ALLOCATIONS
+#include "allocation_counter.h"
+#endif
 #include <iostream>
 #include <random>
 #include <algorithm>
 #include <cmath>
+#include <cstdlib>
 
 using namespace std;
 
-Inference::Inference(NeuralNetwork* network, Tokenizer* tokenizer)
-    : neuralNetwork(network), tokenizer(tokenizer), contextLength(32) {
+Inference::Inference(const NeuralNetwork* network, Tokenizer* tokenizer)
+    : neuralNetwork(network), tokenizer(tokenizer), sentenceIndex(nullptr), forwardCache(nullptr) {
 }
 
 Inference::~Inference() {
 }
 
 string Inference::generateResponse(const string& question, int maxTokens) {
+    return generateResponseStream(question, maxTokens, nullptr);
+}
+
+string Inference::generateText(const string& prompt, int maxTokens) {
+    return generateTextStream(prompt, maxTokens, nullptr);
+}
+
+string Inference::generateResponseStream(const string& question, int maxTokens, const function<bool(const string&)>& onText) {
     vector<int> questionTokens = tokenizer->tokenize(question);
 
     if (questionTokens.empty()) {
-        return "I don't understand the question.";
+        string response = "I don't understand the question.";
+        if (onText) {
+            onText(response);
+        }
+        return response;
     }
 
-    vector<int> context = questionTokens;
-
-    if (context.size() > contextLength) {
-        context = vector<int>(context.end() - contextLength, context.end());
+    vector<int> context;
+    if (sentenceIndex != nullptr && sentenceIndex->size() > 0) {
+        auto matches = sentenceIndex->search(question, 1);
+        if (!matches.empty() && matches[0].second > 0.0f) {
+            context = tokenizer->tokenize(sentenceIndex->getSentence(matches[0].first));
+        }
     }
+    context.insert(context.end(), questionTokens.begin(), questionTokens.end());
 
-    vector<int> responseTokens = generateNextTokens(context, maxTokens);
+    bool startOfText = true;
+    auto streamToken = [&](int token) {
+        string text = tokenizer->getTokenText(token, startOfText);
+        if (startOfText) {
+            text.erase(0, text.find_first_not_of(" \t"));
+        }
+        if (text.empty()) {
+            return true;
+        }
+        startOfText = false;
+        return onText(text);
+    };
+
+    vector<int> responseTokens = onText ? generateNextTokens(context, maxTokens, streamToken)
+                                        : generateNextTokens(context, maxTokens);
 
     string response = tokenizer->detokenize(responseTokens);
+    response.erase(0, response.find_first_not_of(" \t"));
 
     if (response.empty()) {
         response = "I need more training data to answer that question.";
+        if (onText) {
+            onText(response);
+        }
     }
 
-    response.erase(0, response.find_first_not_of(" \t"));
-    response.erase(response.find_last_not_of(" \t") + 1);
-
     return response;
 }
 
-string Inference::generateText(const string& prompt, int maxTokens) {
+string Inference::generateTextStream(const string& prompt, int maxTokens, const function<bool(const string&)>& onText) {
     vector<int> promptTokens = tokenizer->tokenize(prompt);
 
     if (promptTokens.empty()) {
         promptTokens.push_back(tokenizer->getTokenId("<START>"));
     }
 
-    vector<int> context = promptTokens;
+    vector<int> generatedTokens;
+    if (onText) {
+        string promptText = tokenizer->detokenize(promptTokens);
+        bool startOfText = promptText.empty();
+        auto streamToken = [&](int token) {
+            string text = tokenizer->getTokenText(token, startOfText);
+            if (text.empty()) {
+                return true;
+            }
+            startOfText = false;
+            return onText(text);
+        };
 
-    if (context.size() > contextLength) {
-        context = vector<int>(context.end() - contextLength, context.end());
+        if (startOfText || onText(promptText)) {
+            generatedTokens = generateNextTokens(promptTokens, maxTokens, streamToken);
+        }
+    } else {
+        generatedTokens = generateNextTokens(promptTokens, maxTokens);
     }
 
-    vector<int> generatedTokens = generateNextTokens(context, maxTokens);
-
     vector<int> fullResponse = promptTokens;
     fullResponse.insert(fullResponse.end(), generatedTokens.begin(), generatedTokens.end());
 
@@ -69,16 +115,12 @@ double Inference::calculateSimilarity(const string& text1, const string& text2)
         return 0.0;
     }
 
-    auto pred1 = neuralNetwork->forward(tokens1);
-    auto pred2 = neuralNetwork->forward(tokens2);
-
-    if (pred1.size() != pred2.size()) {
-        return 0.0;
-    }
+    Eigen::VectorXd embedding1 = neuralNetwork->pooledEmbedding(tokens1);
+    Eigen::VectorXd embedding2 = neuralNetwork->pooledEmbedding(tokens2);
 
-    double dotProduct = pred1.dot(pred2);
-    double norm1 = pred1.norm();
-    double norm2 = pred2.norm();
+    double dotProduct = embedding1.dot(embedding2);
+    double norm1 = embedding1.norm();
+    double norm2 = embedding2.norm();
 
     if (norm1 == 0.0 || norm2 == 0.0) {
         return 0.0;
@@ -87,29 +129,87 @@ double Inference::calculateSimilarity(const string& text1, const string& text2)
     return dotProduct / (norm1 * norm2);
 }
 
-vector<int> Inference::generateNextTokens(const vector<int>& context, int numTokens) {
+void Inference::setSentenceIndex(const SentenceIndex* index) {
+    sentenceIndex = index;
+}
+
+void Inference::setForwardCache(ForwardCache* cache) {
+    forwardCache = cache;
+}
+
+vector<int> Inference::generateNextTokens(const vector<int>& context, int numTokens,
+                                          const function<bool(int)>& onToken) {
     vector<int> result;
-    vector<int> currentContext = context;
+    result.reserve(max(numTokens, 0));
+
+    ContextWindow currentContext(neuralNetwork->getContextLength());
+    for (int token : context) {
+        currentContext.push(token);
+    }
+
+    NeuralNetwork::ForwardState state;
+    neuralNetwork->prepareState(state);
+
+    random_device rd;
+    SamplerState sampler;
+    sampler.generator.seed(rd());
+    sampler.adjustedProbs.resize(state.output.size());
+    sampler.probIndexPairs.reserve(state.output.size());
+
+    int endTokenId = tokenizer->getTokenId("<END>");
+    int padTokenId = tokenizer->getTokenId("<PAD>");
 
     for (int i = 0; i < numTokens; i++) {
-        if (currentContext.size() > contextLength) {
-            currentContext = vector<int>(currentContext.end() - contextLength, currentContext.end());
-        }
+#ifdef LITLM_CHECK_GENERATION_ALLOCATIONS
+        size_t allocationsBefore = AllocationCounter::count();
+#endif
+#ifdef EIGEN_RUNTIME_NO_MALLOC
+        Eigen::internal::set_is_malloc_allowed(false);
+#endif
+        int nextToken;
+        if (forwardCache != nullptr) {
+            uint64_t key = currentContext.hash();
+            if (!forwardCache->lookup(key, currentContext.data(), currentContext.size(), sampler.probIndexPairs)) {
+                const Eigen::VectorXd& probabilities = neuralNetwork->forward(currentContext.data(), currentContext.size(), state);
+                if (probabilities.size() == 0) {
+                    break;
+                }
+                selectCandidates(probabilities, sampler);
+                sampler.probIndexPairs.resize(min(sampler.probIndexPairs.size(), (size_t)forwardCache->getMaxCandidates()));
+                forwardCache->insert(key, currentContext.data(), currentContext.size(), sampler.probIndexPairs);
+            }
+            nextToken = sampleCandidate(sampler);
+        } else {
+            const Eigen::VectorXd& probabilities = neuralNetwork->forward(currentContext.data(), currentContext.size(), state);
 
-        auto probabilities = neuralNetwork->forward(currentContext);
+            if (probabilities.size() == 0) {
+                break;
+            }
 
-        if (probabilities.size() == 0) {
-            break;
+            nextToken = sampleFromProbabilities(probabilities, sampler);
         }
+#ifdef EIGEN_RUNTIME_NO_MALLOC
+        Eigen::internal::set_is_malloc_allowed(true);
+#endif
 
-        int nextToken = sampleFromProbabilities(probabilities);
-
-        if (nextToken == tokenizer->getTokenId("<END>") || nextToken == tokenizer->getTokenId("<PAD>")) {
+        if (nextToken == endTokenId || nextToken == padTokenId) {
             break;
         }
 
         result.push_back(nextToken);
-        currentContext.push_back(nextToken);
+        currentContext.push(nextToken);
+
+#ifdef LITLM_CHECK_GENERATION_ALLOCATIONS
+        size_t tokenAllocations = AllocationCounter::count() - allocationsBefore;
+        if (tokenAllocations != 0) {
+            cout << "Error: Generating token " << i << " performed " << tokenAllocations << " heap allocation(s)." << endl;
+            abort();
+        }
+#endif
+
+        if (onToken && !onToken(nextToken)) {
+            break;
+        }
 
         if (result.size() >= 3) {
             bool hasRepeatingPattern = true;
@@ -128,51 +228,101 @@ vector<int> Inference::generateNextTokens(const vector<int>& context, int numTok
         }
     }
 
+#ifdef EIGEN_RUNTIME_NO_MALLOC
+    Eigen::internal::set_is_malloc_allowed(true);
+#endif
     return result;
 }
 
-int Inference::sampleFromProbabilities(const Eigen::VectorXd& probabilities) {
-    random_device rd;
-    mt19937 gen(rd());
+int Inference::sampleFromProbabilities(const Eigen::VectorXd& probabilities, SamplerState& sampler) {
+    selectCandidates(probabilities, sampler);
+    return sampleCandidate(sampler);
+}
 
+void Inference::selectCandidates(const Eigen::VectorXd& probabilities, SamplerState& sampler) {
     double temperature = 0.8;
-    Eigen::VectorXd adjustedProbs = probabilities.array().pow(1.0 / temperature);
-    adjustedProbs = adjustedProbs / adjustedProbs.sum();
+    Eigen::VectorXd& adjustedProbs = sampler.adjustedProbs;
+    adjustedProbs.resize(probabilities.size());
+    adjustedProbs.array() = probabilities.array().pow(1.0 / temperature);
+    adjustedProbs /= adjustedProbs.sum();
 
     double topP = 0.9;
-    vector<pair<double, int>> probIndexPairs;
+    vector<pair<double, int>>& probIndexPairs = sampler.probIndexPairs;
+    probIndexPairs.clear();
     for (int i = 0; i < adjustedProbs.size(); i++) {
         probIndexPairs.emplace_back(adjustedProbs[i], i);
     }
     sort(probIndexPairs.rbegin(), probIndexPairs.rend());
 
     double cumulativeProb = 0.0;
-    vector<pair<double, int>> filteredPairs;
+    int filteredCount = 0;
     for (const auto& pair : probIndexPairs) {
         cumulativeProb += pair.first;
-        filteredPairs.push_back(pair);
+        filteredCount++;
         if (cumulativeProb >= topP) break;
     }
+    probIndexPairs.resize(filteredCount);
+}
 
-    if (filteredPairs.empty()) {
-        filteredPairs = probIndexPairs;
+int Inference::sampleCandidate(SamplerState& sampler) {
+    const vector<pair<double, int>>& probIndexPairs = sampler.probIndexPairs;
+    int filteredCount = (int)probIndexPairs.size();
+    if (filteredCount == 0) {
+        return 0;
     }
 
-    double totalProb = 0.0;
-    for (const auto& pair : filteredPairs) {
-        totalProb += pair.first;
+    double cumulativeProb = 0.0;
+    for (const auto& pair : probIndexPairs) {
+        cumulativeProb += pair.first;
     }
 
-    uniform_real_distribution<double> dist(0.0, totalProb);
-    double randomValue = dist(gen);
+    uniform_real_distribution<double> dist(0.0, cumulativeProb);
+    double randomValue = dist(sampler.generator);
 
     double currentSum = 0.0;
-    for (const auto& pair : filteredPairs) {
-        currentSum += pair.first;
+    for (int i = 0; i < filteredCount; i++) {
+        currentSum += probIndexPairs[i].first;
         if (randomValue <= currentSum) {
-            return pair.second;
+            return probIndexPairs[i].second;
         }
     }
 
-    return filteredPairs.empty() ? 0 : filteredPairs.back().second;
-}
\ No newline at end of file
+    return probIndexPairs[filteredCount - 1].second;
+}
+
+static const uint64_t contextHashBase = 1099511628211ULL;
+
+Inference::ContextWindow::ContextWindow(int capacity)
+    : buffer(2 * max(capacity, 1)), capacity(max(capacity, 1)), start(0), count(0), rollingHash(0), leadingPower(1) {
+    for (int i = 1; i < this->capacity; i++) {
+        leadingPower *= contextHashBase;
+    }
+}
+
+void Inference::ContextWindow::push(int token) {
+    if (count < capacity) {
+        buffer[count] = token;
+        buffer[count + capacity] = token;
+        count++;
+        rollingHash = rollingHash * contextHashBase + (uint64_t)token + 1;
+        return;
+    }
+
+    rollingHash -= ((uint64_t)buffer[start] + 1) * leadingPower;
+    rollingHash = rollingHash * contextHashBase + (uint64_t)token + 1;
+    buffer[start] = token;
+    buffer[start + capacity] = token;
+    start = (start + 1) % capacity;
+}
+
+const int* Inference::ContextWindow::data() const {
+    return buffer.data() + start;
+}
+
+int Inference::ContextWindow::size() const {
+    return count;
+}
+
+uint64_t Inference::ContextWindow::hash() const {
+    return rollingHash;
+}
@@ -1,11 +1,17 @@
 #include <iostream>
 #include <string>
 #include <vector>
+#include <memory>
+#include <cctype>
 #include "text_processor.h"
 #include "tokenizer.h"
+#include "bpe_tokenizer.h"
 #include "neural_network.h"
 #include "trainer.h"
 #include "inference.h"
+#include "sentence_index.h"
+#include "forward_cache.h"
+#include "token_cache.h"
 
 using namespace std;
 
@@ -19,17 +25,73 @@ void printMenu() {
     cout << "6. Save model\n";
     cout << "7. Load model\n";
     cout << "8. Exit\n";
+    cout << "9. Build token cache from loaded text\n";
+    cout << "10. Train from token cache\n";
     cout << "Enter your choice: ";
 }
 
-int main() {
+vector<string> collectSentences(TextProcessor& textProcessor, const vector<string>& texts, size_t first) {
+    vector<string> sentences;
+    for (size_t i = first; i < texts.size(); i++) {
+        vector<string> textSentences = textProcessor.splitIntoSentences(texts[i]);
+        sentences.insert(sentences.end(), textSentences.begin(), textSentences.end());
+    }
+    return sentences;
+}
+
+int main(int argc, char* argv[]) {
     TextProcessor textProcessor;
-    Tokenizer tokenizer;
-    NeuralNetwork neuralNetwork(1000, 128, 256, 32);
-    Trainer trainer(&neuralNetwork, &tokenizer);
-    Inference inference(&neuralNetwork, &tokenizer);
+    unique_ptr<Tokenizer> tokenizer;
+    ContextEncoder contextEncoder = ContextEncoder::Concatenated;
+    int contextLength = 32;
+    bool fusedUpdates = false;
+    bool deduplicateSamples = false;
+    size_t forwardCacheEntries = 0;
+    int forwardCacheCandidates = 64;
+    for (int i = 1; i < argc; i++) {
+        string option = argv[i];
+        bool hasValue = i + 1 < argc && isdigit((unsigned char)argv[i + 1][0]);
+        if (option == "--bpe") {
+            int targetVocabSize = hasValue ? stoi(argv[++i]) : 8000;
+            tokenizer = make_unique<BpeTokenizer>(targetVocabSize);
+        } else if (option == "--bag-context") {
+            contextEncoder = ContextEncoder::PositionWeightedBag;
+            contextLength = hasValue ? stoi(argv[++i]) : 128;
+        } else if (option == "--fused-updates") {
+            fusedUpdates = true;
+        } else if (option == "--dedup-samples") {
+            deduplicateSamples = true;
+        } else if (option == "--forward-cache") {
+            forwardCacheEntries = hasValue ? stoul(argv[++i]) : 4096;
+        } else if (option == "--cache-candidates") {
+            forwardCacheCandidates = hasValue ? stoi(argv[++i]) : 64;
+            if (forwardCacheCandidates <= 0) {
+                cout << "Error: --cache-candidates must be at least 1." << endl;
+                return 1;
+            }
+        }
+    }
+    if (!tokenizer) {
+        tokenizer = make_unique<Tokenizer>();
+    }
+
+    NeuralNetwork neuralNetwork(tokenizer->getVocabSize(), 128, 256, contextLength, contextEncoder);
+    Trainer trainer(&neuralNetwork, tokenizer.get());
+    trainer.setValidationSplit(0.1);
+    trainer.setEarlyStopping(2);
+    trainer.setDeduplicateSamples(deduplicateSamples);
+    trainer.setFusedUpdates(fusedUpdates);
+    Inference inference(&neuralNetwork, tokenizer.get());
+    SentenceIndex sentenceIndex(&neuralNetwork, tokenizer.get());
+    inference.setSentenceIndex(&sentenceIndex);
+    unique_ptr<ForwardCache> forwardCache;
+    if (forwardCacheEntries > 0) {
+        forwardCache = make_unique<ForwardCache>(forwardCacheEntries, contextLength, forwardCacheCandidates);
+        inference.setForwardCache(forwardCache.get());
+    }
 
     vector<string> loadedTexts;
+    size_t trainedTextCount = 0;
     bool modelTrained = false;
 
     cout << "Welcome to LitLM - Literature Language Model in C++!\n";
@@ -46,9 +108,10 @@ int main() {
                 string filename;
                 getline(cin, filename);
 
+                size_t previousLength = textProcessor.getRawText().size();
                 if (textProcessor.loadFromFile(filename)) {
                     cout << "File loaded successfully!\n";
-                    loadedTexts.push_back(textProcessor.getRawText());
+                    loadedTexts.push_back(textProcessor.getRawText().substr(previousLength));
                 } else {
                     cout << "Error loading file.\n";
                 }
@@ -74,13 +137,28 @@ int main() {
                     break;
                 }
 
+                if (trainedTextCount == loadedTexts.size()) {
+                    cout << "No new text since the last training run.\n";
+                    break;
+                }
+
+                vector<string> newTexts(loadedTexts.begin() + trainedTextCount, loadedTexts.end());
+
                 cout << "Building vocabulary...\n";
-                tokenizer.buildVocabulary(loadedTexts);
-                cout << "Vocabulary size: " << tokenizer.getVocabSize() << "\n";
+                tokenizer->buildVocabulary(newTexts);
+                neuralNetwork.growVocabulary(tokenizer->getVocabSize());
+                cout << "Vocabulary size: " << tokenizer->getVocabSize() << "\n";
 
-                cout << "Training model...\n";
-                trainer.trainOnText(loadedTexts, 10, 0.001);
+                cout << "Training model on " << newTexts.size() << " new text(s)...\n";
+                trainer.trainOnText(newTexts, 10, 0.001);
+                sentenceIndex.add(collectSentences(textProcessor, loadedTexts, trainedTextCount));
+                trainedTextCount = loadedTexts.size();
                 modelTrained = true;
+                if (forwardCache) {
+                    forwardCache->clear();
+                }
+
+                cout << "Indexed " << sentenceIndex.size() << " sentences for retrieval.\n";
                 cout << "Model trained successfully!\n";
                 break;
             }
@@ -95,8 +173,12 @@ int main() {
                 string question;
                 getline(cin, question);
 
-                string response = inference.generateResponse(question);
-                cout << "Response: " << response << "\n";
+                cout << "Response: " << flush;
+                inference.generateResponseStream(question, 100, [](const string& text) {
+                    cout << text << flush;
+                    return true;
+                });
+                cout << "\n";
                 break;
             }
 
@@ -110,8 +192,12 @@ int main() {
                 string prompt;
                 getline(cin, prompt);
 
-                string generated = inference.generateText(prompt);
-                cout << "Generated text: " << generated << "\n";
+                cout << "Generated text: " << flush;
+                inference.generateTextStream(prompt, 50, [](const string& text) {
+                    cout << text << flush;
+                    return true;
+                });
+                cout << "\n";
                 break;
             }
 
@@ -136,16 +222,82 @@ int main() {
                 getline(cin, filename);
 
                 neuralNetwork.loadModel(filename);
+                trainer.setContextLength(neuralNetwork.getContextLength());
+                if (forwardCache) {
+                    forwardCache = make_unique<ForwardCache>(forwardCacheEntries, neuralNetwork.getContextLength(), forwardCacheCandidates);
+                    inference.setForwardCache(forwardCache.get());
+                }
+                sentenceIndex.build(collectSentences(textProcessor, loadedTexts, 0));
                 modelTrained = true;
                 cout << "Model loaded successfully!\n";
                 break;
             }
 
             case 8: {
+                if (forwardCache && forwardCache->getHits() + forwardCache->getMisses() > 0) {
+                    cout << "Forward cache: " << forwardCache->getHitRate() * 100.0 << "% hit rate, "
+                         << forwardCache->getEvictions() << " evictions\n";
+                }
                 cout << "Thank you for using LitLM!\n";
                 return 0;
             }
 
+            case 9: {
+                if (loadedTexts.empty()) {
+                    cout << "No text loaded. Please load some text first.\n";
+                    break;
+                }
+
+                cout << "Enter filename for token cache: ";
+                string filename;
+                getline(cin, filename);
+
+                vector<string> newTexts(loadedTexts.begin() + trainedTextCount, loadedTexts.end());
+                if (!newTexts.empty()) {
+                    tokenizer->buildVocabulary(newTexts);
+                    neuralNetwork.growVocabulary(tokenizer->getVocabSize());
+                }
+
+                if (TokenCache::build(filename, loadedTexts, tokenizer.get())) {
+                    cout << "Token cache written for " << loadedTexts.size() << " text(s).\n";
+                }
+                break;
+            }
+
+            case 10: {
+                cout << "Enter token cache filename: ";
+                string filename;
+                getline(cin, filename);
+
+                TokenCache corpus;
+                if (!corpus.open(filename)) {
+                    break;
+                }
+
+                if (corpus.getFingerprint() != tokenizer->getFingerprint()) {
+                    if (modelTrained) {
+                        cout << "Token cache was built with a different vocabulary than the current model.\n";
+                        break;
+                    }
+                    if (!corpus.loadTokenizer(tokenizer.get())) {
+                        break;
+                    }
+                    cout << "Vocabulary loaded from token cache: " << tokenizer->getVocabSize() << " tokens.\n";
+                }
+                neuralNetwork.growVocabulary(tokenizer->getVocabSize());
+
+                cout << "Training model on " << corpus.getDocumentCount() << " cached document(s), "
+                     << corpus.getTokenCount() << " tokens...\n";
+                trainer.trainOnCorpus(corpus, 10, 0.001);
+                sentenceIndex.refresh();
+                modelTrained = true;
+                if (forwardCache) {
+                    forwardCache->clear();
+                }
+                cout << "Model trained successfully!\n";
+                break;
+            }
+
             default: {
                 cout << "Invalid choice. Please try again.\n";
                 break;
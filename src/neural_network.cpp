@@ -6,8 +6,13 @@
 
 using namespace std;
 
-NeuralNetwork::NeuralNetwork(int vocabSize, int embeddingDim, int hiddenDim, int contextLength)
-    : vocabSize(vocabSize), embeddingDim(embeddingDim), hiddenDim(hiddenDim), contextLength(contextLength) {
+static const int extendedFormatTag = -1;
+
+NeuralNetwork::NeuralNetwork(int vocabSize, int embeddingDim, int hiddenDim, int contextLength,
+                             ContextEncoder contextEncoder)
+    : vocabSize(vocabSize), vocabCapacity(vocabSize), embeddingDim(embeddingDim), hiddenDim(hiddenDim),
+      contextLength(contextLength), contextEncoder(contextEncoder), hiddenGradientRows(0),
+      positionGradientColumns(0), fusedUpdates(false) {
     initializeWeights();
 }
 
@@ -19,19 +24,20 @@ void NeuralNetwork::initializeWeights() {
     mt19937 gen(rd());
     normal_distribution<double> dist(0.0, 0.1);
 
-    embeddingMatrix = Eigen::MatrixXd::Zero(vocabSize, embeddingDim);
-    hiddenWeights = Eigen::MatrixXd::Zero(embeddingDim * contextLength, hiddenDim);
+    vocabCapacity = vocabSize;
+    embeddingMatrix = Eigen::MatrixXd::Zero(vocabCapacity, embeddingDim);
+    hiddenWeights = Eigen::MatrixXd::Zero(inputRows(), hiddenDim);
     hiddenBias = Eigen::VectorXd::Zero(hiddenDim);
-    outputWeights = Eigen::MatrixXd::Zero(hiddenDim, vocabSize);
-    outputBias = Eigen::VectorXd::Zero(vocabSize);
+    outputWeights = Eigen::MatrixXd::Zero(hiddenDim, vocabCapacity);
+    outputBias = Eigen::VectorXd::Zero(vocabCapacity);
 
-    for (int i = 0; i < vocabSize; i++) {
-        for (int j = 0; j < embeddingDim; j++) {
-            embeddingMatrix(i, j) = dist(gen);
-        }
+    if (contextEncoder == ContextEncoder::PositionWeightedBag) {
+        positionWeights = Eigen::MatrixXd::Ones(embeddingDim, contextLength);
+    } else {
+        positionWeights.resize(0, 0);
     }
 
-    for (int i = 0; i < embeddingDim * contextLength; i++) {
+    for (int i = 0; i < inputRows(); i++) {
         for (int j = 0; j < hiddenDim; j++) {
             hiddenWeights(i, j) = dist(gen);
         }
@@ -39,80 +45,385 @@ void NeuralNetwork::initializeWeights() {
 
     for (int i = 0; i < hiddenDim; i++) {
         hiddenBias(i) = dist(gen);
-        for (int j = 0; j < vocabSize; j++) {
+    }
+
+    initializeVocabularyRows(0, vocabSize, gen);
+
+    allocateGradients();
+}
+
+void NeuralNetwork::initializeVocabularyRows(int first, int last, mt19937& gen) {
+    normal_distribution<double> dist(0.0, 0.1);
+
+    for (int i = first; i < last; i++) {
+        for (int j = 0; j < embeddingDim; j++) {
+            embeddingMatrix(i, j) = dist(gen);
+        }
+    }
+
+    for (int j = first; j < last; j++) {
+        for (int i = 0; i < hiddenDim; i++) {
             outputWeights(i, j) = dist(gen);
         }
     }
 
-    for (int i = 0; i < vocabSize; i++) {
+    for (int i = first; i < last; i++) {
         outputBias(i) = dist(gen);
     }
+}
 
-    embeddingGradients = Eigen::MatrixXd::Zero(vocabSize, embeddingDim);
-    hiddenWeightsGradients = Eigen::MatrixXd::Zero(embeddingDim * contextLength, hiddenDim);
+void NeuralNetwork::growVocabulary(int newVocabSize) {
+    if (newVocabSize <= vocabSize) {
+        return;
+    }
+
+    if (newVocabSize > vocabCapacity) {
+        vocabCapacity = max(newVocabSize, vocabCapacity + vocabCapacity / 2);
+        embeddingMatrix.conservativeResize(vocabCapacity, Eigen::NoChange);
+        outputWeights.conservativeResize(Eigen::NoChange, vocabCapacity);
+        outputBias.conservativeResize(vocabCapacity);
+
+        if (!fusedUpdates) {
+            embeddingGradients = Eigen::MatrixXd::Zero(vocabCapacity, embeddingDim);
+            outputWeightsGradients = Eigen::MatrixXd::Zero(hiddenDim, vocabCapacity);
+            outputBiasGradients = Eigen::VectorXd::Zero(vocabCapacity);
+        }
+    }
+
+    random_device rd;
+    mt19937 gen(rd());
+    initializeVocabularyRows(vocabSize, newVocabSize, gen);
+    vocabSize = newVocabSize;
+}
+
+int NeuralNetwork::getVocabSize() const {
+    return vocabSize;
+}
+
+int NeuralNetwork::getEmbeddingDim() const {
+    return embeddingDim;
+}
+
+int NeuralNetwork::getContextLength() const {
+    return contextLength;
+}
+
+ContextEncoder NeuralNetwork::getContextEncoder() const {
+    return contextEncoder;
+}
+
+uint64_t NeuralNetwork::getFingerprint() const {
+    uint64_t hash = 1469598103934665603ull;
+    auto mix = [&hash](const void* data, size_t size) {
+        const unsigned char* bytes = static_cast<const unsigned char*>(data);
+        for (size_t i = 0; i < size; i++) {
+            hash ^= bytes[i];
+            hash *= 1099511628211ull;
+        }
+    };
+
+    mix(&vocabSize, sizeof(vocabSize));
+    mix(&embeddingDim, sizeof(embeddingDim));
+    for (int j = 0; j < embeddingDim; j++) {
+        mix(embeddingMatrix.col(j).data(), sizeof(double) * vocabSize);
+    }
+    return hash;
+}
+
+Eigen::VectorXd NeuralNetwork::pooledEmbedding(const vector<int>& tokens) const {
+    Eigen::VectorXd pooled = Eigen::VectorXd::Zero(embeddingDim);
+    int count = 0;
+    for (int token : tokens) {
+        if (token < vocabSize && token >= 0) {
+            pooled += embeddingMatrix.row(token).transpose();
+            count++;
+        }
+    }
+    if (count > 0) {
+        pooled /= count;
+    }
+    return pooled;
+}
+
+void NeuralNetwork::allocateGradients() {
+    hiddenGradientRows = 0;
+    positionGradientColumns = 0;
+
+    if (fusedUpdates) {
+        embeddingGradients.resize(0, 0);
+        hiddenWeightsGradients.resize(0, 0);
+        hiddenBiasGradients.resize(0);
+        outputWeightsGradients.resize(0, 0);
+        outputBiasGradients.resize(0);
+        positionWeightsGradients.resize(0, 0);
+        return;
+    }
+
+    embeddingGradients = Eigen::MatrixXd::Zero(vocabCapacity, embeddingDim);
+    hiddenWeightsGradients = Eigen::MatrixXd::Zero(inputRows(), hiddenDim);
     hiddenBiasGradients = Eigen::VectorXd::Zero(hiddenDim);
-    outputWeightsGradients = Eigen::MatrixXd::Zero(hiddenDim, vocabSize);
-    outputBiasGradients = Eigen::VectorXd::Zero(vocabSize);
+    outputWeightsGradients = Eigen::MatrixXd::Zero(hiddenDim, vocabCapacity);
+    outputBiasGradients = Eigen::VectorXd::Zero(vocabCapacity);
+    positionWeightsGradients = Eigen::MatrixXd::Zero(positionWeights.rows(), positionWeights.cols());
+}
+
+int NeuralNetwork::inputRows() const {
+    return encodedRows(contextLength);
+}
+
+int NeuralNetwork::encodedRows(int actualContextLength) const {
+    if (contextEncoder == ContextEncoder::PositionWeightedBag) {
+        return embeddingDim;
+    }
+    return actualContextLength * embeddingDim;
+}
+
+void NeuralNetwork::setFusedUpdates(bool enabled) {
+    if (fusedUpdates == enabled) {
+        return;
+    }
+    fusedUpdates = enabled;
+    allocateGradients();
+}
+
+bool NeuralNetwork::usesFusedUpdates() const {
+    return fusedUpdates;
+}
+
+Eigen::VectorXd NeuralNetwork::forward(const vector<int>& inputTokens, ForwardState& state) const {
+    return forward(inputTokens.data(), (int)inputTokens.size(), state);
+}
+
+const Eigen::VectorXd& NeuralNetwork::forward(const int* inputTokens, int count, ForwardState& state) const {
+    forwardLogits(inputTokens, count, state);
+    softmaxInPlace(state.output);
+    return state.output;
+}
+
+const Eigen::VectorXd& NeuralNetwork::forwardLogits(const int* inputTokens, int count, ForwardState& state) const {
+    int actualContextLength = min(count, contextLength);
+    int activeRows = encodedRows(actualContextLength);
+
+    prepareState(state);
+    state.inputTokens.assign(inputTokens, inputTokens + actualContextLength);
+    encodeContext(state);
+
+    state.hiddenActivations.noalias() = hiddenWeights.topRows(activeRows).transpose() * state.embeddings.head(activeRows);
+    state.hiddenActivations += hiddenBias;
+    state.hiddenActivations = state.hiddenActivations.cwiseMax(0.0);
+
+    state.output.noalias() = outputWeights.leftCols(vocabSize).transpose() * state.hiddenActivations;
+    state.output += outputBias.head(vocabSize);
+    return state.output;
 }
 
-Eigen::VectorXd NeuralNetwork::forward(const vector<int>& inputTokens) {
-    int actualContextLength = min((int)inputTokens.size(), contextLength);
+void NeuralNetwork::encodeContext(ForwardState& state) const {
+    const vector<int>& inputTokens = state.inputTokens;
+    int count = (int)inputTokens.size();
+    state.embeddings.head(encodedRows(count)).setZero();
 
-    embeddings = Eigen::VectorXd::Zero(embeddingDim * contextLength);
+    if (contextEncoder == ContextEncoder::Concatenated) {
+        for (int i = 0; i < count; i++) {
+            if (inputTokens[i] < vocabSize && inputTokens[i] >= 0) {
+                state.embeddings.segment(i * embeddingDim, embeddingDim) = embeddingMatrix.row(inputTokens[i]);
+            }
+        }
+        return;
+    }
 
-    for (int i = 0; i < actualContextLength; i++) {
+    auto pooled = state.embeddings.head(embeddingDim);
+    for (int i = 0; i < count; i++) {
         if (inputTokens[i] < vocabSize && inputTokens[i] >= 0) {
-            embeddings.segment(i * embeddingDim, embeddingDim) = embeddingMatrix.row(inputTokens[i]);
+            int position = count - 1 - i;
+            pooled += positionWeights.col(position).cwiseProduct(embeddingMatrix.row(inputTokens[i]).transpose());
         }
     }
+    if (count > 0) {
+        pooled /= count;
+    }
+}
 
-    Eigen::VectorXd hiddenInput = hiddenWeights.transpose() * embeddings + hiddenBias;
-    hiddenActivations = relu(hiddenInput);
+void NeuralNetwork::prepareState(ForwardState& state) const {
+    if (state.inputTokens.capacity() < (size_t)contextLength) {
+        state.inputTokens.reserve(contextLength);
+    }
+    if (state.embeddings.size() != inputRows()) {
+        state.embeddings.resize(inputRows());
+    }
+    if (state.hiddenActivations.size() != hiddenDim) {
+        state.hiddenActivations.resize(hiddenDim);
+    }
+    if (state.output.size() != vocabSize) {
+        state.output.resize(vocabSize);
+    }
+}
 
-    Eigen::VectorXd output = outputWeights.transpose() * hiddenActivations + outputBias;
-    return softmax(output);
+double NeuralNetwork::crossEntropyLoss(const ForwardState& state, const vector<int>& target) const {
+    const Eigen::VectorXd& logits = state.output;
+    double maxLogit = logits.maxCoeff();
+    double logSumExp = maxLogit + log((logits.array() - maxLogit).exp().sum());
+    return logSumExp - targetLogitMean(logits, target);
 }
 
-void NeuralNetwork::backward(const Eigen::VectorXd& prediction, const vector<int>& target) {
-    embeddingGradients.setZero();
-    hiddenWeightsGradients.setZero();
-    hiddenBiasGradients.setZero();
-    outputWeightsGradients.setZero();
-    outputBiasGradients.setZero();
+double NeuralNetwork::softmaxCrossEntropy(ForwardState& state, const vector<int>& target, double weight) const {
+    Eigen::VectorXd& logits = state.output;
+    double targetMean = targetLogitMean(logits, target);
+    double maxLogit = logits.maxCoeff();
+    double sum = expInPlace(logits, maxLogit);
+    logits *= weight / sum;
 
-    Eigen::VectorXd targetVector = Eigen::VectorXd::Zero(vocabSize);
     for (int token : target) {
         if (token < vocabSize && token >= 0) {
-            targetVector(token) = 1.0 / target.size();
+            logits(token) -= weight / target.size();
         }
     }
 
-    Eigen::VectorXd outputError = prediction - targetVector;
+    return maxLogit + log(sum) - targetMean;
+}
 
-    outputWeightsGradients = hiddenActivations * outputError.transpose();
-    outputBiasGradients = outputError;
+void NeuralNetwork::backward(const ForwardState& state) {
+    if (fusedUpdates) {
+        cout << "Error: backward() has no gradient buffers in fused update mode; use backwardAndUpdate()." << endl;
+        return;
+    }
+
+    const Eigen::VectorXd& outputError = state.output;
+    int activeRows = encodedRows((int)state.inputTokens.size());
 
-    Eigen::VectorXd hiddenError = outputWeights * outputError;
-    Eigen::VectorXd hiddenGradient = hiddenError.cwiseProduct(reluDerivative(hiddenActivations));
+    outputWeightsGradients.leftCols(vocabSize).noalias() += state.hiddenActivations * outputError.transpose();
+    outputBiasGradients.head(vocabSize) += outputError;
 
-    hiddenWeightsGradients = embeddings * hiddenGradient.transpose();
-    hiddenBiasGradients = hiddenGradient;
+    Eigen::VectorXd hiddenError = outputWeights.leftCols(vocabSize) * outputError;
+    Eigen::VectorXd hiddenGradient = hiddenError.cwiseProduct(reluDerivative(state.hiddenActivations));
 
-    Eigen::VectorXd embeddingError = hiddenWeights * hiddenGradient;
+    hiddenWeightsGradients.topRows(activeRows).noalias() += state.embeddings.head(activeRows) * hiddenGradient.transpose();
+    hiddenGradientRows = max(hiddenGradientRows, activeRows);
+    hiddenBiasGradients += hiddenGradient;
+
+    Eigen::VectorXd inputError = hiddenWeights.topRows(activeRows) * hiddenGradient;
+    accumulateContextGradients(state, inputError);
+}
 
-    for (int i = 0; i < min((int)target.size(), contextLength); i++) {
-        if (target[i] < vocabSize && target[i] >= 0) {
-            embeddingGradients.row(target[i]) += embeddingError.segment(i * embeddingDim, embeddingDim).transpose();
+void NeuralNetwork::backwardAndUpdate(const ForwardState& state, double learningRate) {
+    const Eigen::VectorXd& outputError = state.output;
+    int activeRows = encodedRows((int)state.inputTokens.size());
+
+    Eigen::VectorXd hiddenError = outputWeights.leftCols(vocabSize) * outputError;
+    Eigen::VectorXd hiddenGradient = hiddenError.cwiseProduct(reluDerivative(state.hiddenActivations));
+    Eigen::VectorXd inputError = hiddenWeights.topRows(activeRows) * hiddenGradient;
+
+    outputWeights.leftCols(vocabSize).noalias() -= state.hiddenActivations * (learningRate * outputError).transpose();
+    outputBias.head(vocabSize) -= learningRate * outputError;
+
+    hiddenWeights.topRows(activeRows).noalias() -= state.embeddings.head(activeRows) * (learningRate * hiddenGradient).transpose();
+    hiddenBias -= learningRate * hiddenGradient;
+
+    applyContextUpdates(state, inputError, learningRate);
+}
+
+void NeuralNetwork::accumulateContextGradients(const ForwardState& state, const Eigen::VectorXd& inputError) {
+    const vector<int>& inputTokens = state.inputTokens;
+    int count = (int)inputTokens.size();
+
+    if (contextEncoder == ContextEncoder::Concatenated) {
+        for (int i = 0; i < count; i++) {
+            if (inputTokens[i] < vocabSize && inputTokens[i] >= 0) {
+                embeddingGradients.row(inputTokens[i]) += inputError.segment(i * embeddingDim, embeddingDim).transpose();
+            }
         }
+        return;
     }
+
+    Eigen::VectorXd pooledError = inputError / max(count, 1);
+    for (int i = 0; i < count; i++) {
+        int position = count - 1 - i;
+        if (inputTokens[i] < vocabSize && inputTokens[i] >= 0) {
+            positionWeightsGradients.col(position) += pooledError.cwiseProduct(embeddingMatrix.row(inputTokens[i]).transpose());
+            embeddingGradients.row(inputTokens[i]) += pooledError.cwiseProduct(positionWeights.col(position)).transpose();
+        }
+    }
+    positionGradientColumns = max(positionGradientColumns, count);
+}
+
+void NeuralNetwork::applyContextUpdates(const ForwardState& state, const Eigen::VectorXd& inputError, double learningRate) {
+    const vector<int>& inputTokens = state.inputTokens;
+    int count = (int)inputTokens.size();
+
+    if (contextEncoder == ContextEncoder::Concatenated) {
+        for (int i = 0; i < count; i++) {
+            if (inputTokens[i] < vocabSize && inputTokens[i] >= 0) {
+                embeddingMatrix.row(inputTokens[i]) -= learningRate * inputError.segment(i * embeddingDim, embeddingDim).transpose();
+            }
+        }
+        return;
+    }
+
+    Eigen::VectorXd pooledError = inputError * (learningRate / max(count, 1));
+    Eigen::MatrixXd positionDeltas = Eigen::MatrixXd::Zero(embeddingDim, count);
+    for (int i = 0; i < count; i++) {
+        if (inputTokens[i] < vocabSize && inputTokens[i] >= 0) {
+            positionDeltas.col(count - 1 - i) = pooledError.cwiseProduct(embeddingMatrix.row(inputTokens[i]).transpose());
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        if (inputTokens[i] < vocabSize && inputTokens[i] >= 0) {
+            embeddingMatrix.row(inputTokens[i]) -= pooledError.cwiseProduct(positionWeights.col(count - 1 - i)).transpose();
+        }
+    }
+    positionWeights.leftCols(count) -= positionDeltas;
 }
 
 void NeuralNetwork::updateWeights(double learningRate) {
-    embeddingMatrix -= learningRate * embeddingGradients;
-    hiddenWeights -= learningRate * hiddenWeightsGradients;
+    if (fusedUpdates) {
+        return;
+    }
+
+    embeddingMatrix.topRows(vocabSize) -= learningRate * embeddingGradients.topRows(vocabSize);
+    hiddenWeights.topRows(hiddenGradientRows) -= learningRate * hiddenWeightsGradients.topRows(hiddenGradientRows);
     hiddenBias -= learningRate * hiddenBiasGradients;
-    outputWeights -= learningRate * outputWeightsGradients;
-    outputBias -= learningRate * outputBiasGradients;
+    outputWeights.leftCols(vocabSize) -= learningRate * outputWeightsGradients.leftCols(vocabSize);
+    outputBias.head(vocabSize) -= learningRate * outputBiasGradients.head(vocabSize);
+
+    if (positionGradientColumns > 0) {
+        positionWeights.leftCols(positionGradientColumns) -= learningRate * positionWeightsGradients.leftCols(positionGradientColumns);
+    }
+
+    embeddingGradients.topRows(vocabSize).setZero();
+    hiddenWeightsGradients.topRows(hiddenGradientRows).setZero();
+    hiddenBiasGradients.setZero();
+    outputWeightsGradients.leftCols(vocabSize).setZero();
+    outputBiasGradients.head(vocabSize).setZero();
+    positionWeightsGradients.leftCols(positionGradientColumns).setZero();
+    hiddenGradientRows = 0;
+    positionGradientColumns = 0;
+}
+
+NeuralNetwork::Checkpoint NeuralNetwork::createCheckpoint() const {
+    Checkpoint checkpoint;
+    checkpoint.vocabSize = vocabSize;
+    checkpoint.embeddingMatrix = embeddingMatrix.topRows(vocabSize);
+    checkpoint.hiddenWeights = hiddenWeights;
+    checkpoint.hiddenBias = hiddenBias;
+    checkpoint.outputWeights = outputWeights.leftCols(vocabSize);
+    checkpoint.outputBias = outputBias.head(vocabSize);
+    checkpoint.positionWeights = positionWeights;
+    return checkpoint;
+}
+
+void NeuralNetwork::restoreCheckpoint(const Checkpoint& checkpoint) {
+    if (checkpoint.vocabSize > vocabSize || checkpoint.hiddenWeights.rows() != hiddenWeights.rows() ||
+        checkpoint.hiddenWeights.cols() != hiddenWeights.cols()) {
+        cout << "Error: Checkpoint does not match the network shape." << endl;
+        return;
+    }
+
+    int rows = checkpoint.vocabSize;
+    embeddingMatrix.topRows(rows) = checkpoint.embeddingMatrix;
+    hiddenWeights = checkpoint.hiddenWeights;
+    hiddenBias = checkpoint.hiddenBias;
+    outputWeights.leftCols(rows) = checkpoint.outputWeights;
+    outputBias.head(rows) = checkpoint.outputBias;
+    positionWeights = checkpoint.positionWeights;
 }
 
 void NeuralNetwork::saveModel(const string& filename) {
@@ -122,16 +433,24 @@ void NeuralNetwork::saveModel(const string& filename) {
         return;
     }
 
+    if (contextEncoder != ContextEncoder::Concatenated) {
+        int encoder = (int)contextEncoder;
+        file.write(reinterpret_cast<const char*>(&extendedFormatTag), sizeof(extendedFormatTag));
+        file.write(reinterpret_cast<const char*>(&encoder), sizeof(encoder));
+    }
     file.write(reinterpret_cast<const char*>(&vocabSize), sizeof(vocabSize));
     file.write(reinterpret_cast<const char*>(&embeddingDim), sizeof(embeddingDim));
     file.write(reinterpret_cast<const char*>(&hiddenDim), sizeof(hiddenDim));
     file.write(reinterpret_cast<const char*>(&contextLength), sizeof(contextLength));
 
-    file.write(reinterpret_cast<const char*>(embeddingMatrix.data()), sizeof(double) * embeddingMatrix.size());
+    for (int j = 0; j < embeddingDim; j++) {
+        file.write(reinterpret_cast<const char*>(embeddingMatrix.col(j).data()), sizeof(double) * vocabSize);
+    }
     file.write(reinterpret_cast<const char*>(hiddenWeights.data()), sizeof(double) * hiddenWeights.size());
     file.write(reinterpret_cast<const char*>(hiddenBias.data()), sizeof(double) * hiddenBias.size());
-    file.write(reinterpret_cast<const char*>(outputWeights.data()), sizeof(double) * outputWeights.size());
-    file.write(reinterpret_cast<const char*>(outputBias.data()), sizeof(double) * outputBias.size());
+    file.write(reinterpret_cast<const char*>(outputWeights.data()), sizeof(double) * hiddenDim * vocabSize);
+    file.write(reinterpret_cast<const char*>(outputBias.data()), sizeof(double) * vocabSize);
+    file.write(reinterpret_cast<const char*>(positionWeights.data()), sizeof(double) * positionWeights.size());
 
     file.close();
 }
@@ -144,41 +463,67 @@ void NeuralNetwork::loadModel(const string& filename) {
     }
 
     file.read(reinterpret_cast<char*>(&vocabSize), sizeof(vocabSize));
+    contextEncoder = ContextEncoder::Concatenated;
+    if (vocabSize == extendedFormatTag) {
+        int encoder = 0;
+        file.read(reinterpret_cast<char*>(&encoder), sizeof(encoder));
+        file.read(reinterpret_cast<char*>(&vocabSize), sizeof(vocabSize));
+        contextEncoder = (ContextEncoder)encoder;
+    }
     file.read(reinterpret_cast<char*>(&embeddingDim), sizeof(embeddingDim));
     file.read(reinterpret_cast<char*>(&hiddenDim), sizeof(hiddenDim));
     file.read(reinterpret_cast<char*>(&contextLength), sizeof(contextLength));
+    vocabCapacity = vocabSize;
 
     embeddingMatrix.resize(vocabSize, embeddingDim);
-    hiddenWeights.resize(embeddingDim * contextLength, hiddenDim);
+    hiddenWeights.resize(inputRows(), hiddenDim);
     hiddenBias.resize(hiddenDim);
     outputWeights.resize(hiddenDim, vocabSize);
     outputBias.resize(vocabSize);
+    if (contextEncoder == ContextEncoder::PositionWeightedBag) {
+        positionWeights.resize(embeddingDim, contextLength);
+    } else {
+        positionWeights.resize(0, 0);
+    }
 
     file.read(reinterpret_cast<char*>(embeddingMatrix.data()), sizeof(double) * embeddingMatrix.size());
     file.read(reinterpret_cast<char*>(hiddenWeights.data()), sizeof(double) * hiddenWeights.size());
     file.read(reinterpret_cast<char*>(hiddenBias.data()), sizeof(double) * hiddenBias.size());
     file.read(reinterpret_cast<char*>(outputWeights.data()), sizeof(double) * outputWeights.size());
     file.read(reinterpret_cast<char*>(outputBias.data()), sizeof(double) * outputBias.size());
+    file.read(reinterpret_cast<char*>(positionWeights.data()), sizeof(double) * positionWeights.size());
 
     file.close();
 
-    embeddingGradients = Eigen::MatrixXd::Zero(vocabSize, embeddingDim);
-    hiddenWeightsGradients = Eigen::MatrixXd::Zero(embeddingDim * contextLength, hiddenDim);
-    hiddenBiasGradients = Eigen::VectorXd::Zero(hiddenDim);
-    outputWeightsGradients = Eigen::MatrixXd::Zero(hiddenDim, vocabSize);
-    outputBiasGradients = Eigen::VectorXd::Zero(vocabSize);
+    allocateGradients();
+}
+
+void NeuralNetwork::softmaxInPlace(Eigen::VectorXd& values) const {
+    double sum = expInPlace(values, values.maxCoeff());
+    values *= 1.0 / sum;
 }
 
-Eigen::VectorXd NeuralNetwork::softmax(const Eigen::VectorXd& input) {
-    Eigen::VectorXd shifted = input.array() - input.maxCoeff();
-    Eigen::VectorXd exp_values = shifted.array().exp();
-    return exp_values / exp_values.sum();
+double NeuralNetwork::expInPlace(Eigen::VectorXd& values, double shift) const {
+    const int blockSize = 512;
+    double sum = 0.0;
+    for (int start = 0; start < values.size(); start += blockSize) {
+        auto block = values.segment(start, min(blockSize, (int)values.size() - start));
+        block.array() = (block.array() - shift).exp();
+        sum += block.sum();
+    }
+    return sum;
 }
 
-Eigen::VectorXd NeuralNetwork::relu(const Eigen::VectorXd& input) {
-    return input.cwiseMax(0.0);
+double NeuralNetwork::targetLogitMean(const Eigen::VectorXd& logits, const vector<int>& target) const {
+    double total = 0.0;
+    for (int token : target) {
+        if (token < vocabSize && token >= 0) {
+            total += logits(token);
+        }
+    }
+    return target.empty() ? 0.0 : total / target.size();
 }
 
-Eigen::VectorXd NeuralNetwork::reluDerivative(const Eigen::VectorXd& input) {
+Eigen::VectorXd NeuralNetwork::reluDerivative(const Eigen::VectorXd& input) const {
     return (input.array() > 0.0).cast<double>();
 }
\ No newline at end of file
@@ -0,0 +1,296 @@
+#include "sentence_index.h"
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <random>
+
+using namespace std;
+
+SentenceIndex::SentenceIndex(const NeuralNetwork* network, Tokenizer* tokenizer)
+    : neuralNetwork(network), tokenizer(tokenizer), dim(network->getEmbeddingDim()), clusteredSize(0),
+      modelFingerprint(0) {
+}
+
+SentenceIndex::~SentenceIndex() {
+}
+
+void SentenceIndex::build(const vector<string>& sentences) {
+    clear();
+    add(sentences);
+}
+
+void SentenceIndex::add(const vector<string>& newSentences) {
+    bool stale = modelFingerprint != currentFingerprint();
+    if (size() == 0 || stale) {
+        dim = neuralNetwork->getEmbeddingDim();
+    }
+
+    int first = size();
+    sentences.insert(sentences.end(), newSentences.begin(), newSentences.end());
+    vectors.resize((size_t)size() * dim);
+    for (int i = stale ? 0 : first; i < size(); i++) {
+        Eigen::Map<Eigen::VectorXf>(vectors.data() + (size_t)i * dim, dim) = embed(sentences[i]);
+    }
+    modelFingerprint = currentFingerprint();
+
+    if (size() >= 4096 && (stale || lists.empty() || size() >= 2 * clusteredSize)) {
+        buildCoarseQuantizer((int)sqrt((double)size()));
+    } else if (stale) {
+        centroids.clear();
+        lists.clear();
+        clusteredSize = 0;
+    } else if (!lists.empty()) {
+        vector<int> assignment;
+        assignToCentroids(first, size(), assignment);
+        for (int i = first; i < size(); i++) {
+            lists[assignment[i - first]].push_back(i);
+        }
+    }
+}
+
+void SentenceIndex::refresh() {
+    add(vector<string>());
+}
+
+void SentenceIndex::clear() {
+    sentences.clear();
+    vectors.clear();
+    centroids.clear();
+    lists.clear();
+    clusteredSize = 0;
+    modelFingerprint = 0;
+}
+
+void SentenceIndex::buildCoarseQuantizer(int numLists, int iterations) {
+    int n = size();
+    numLists = min(numLists, n);
+    centroids.clear();
+    lists.clear();
+    clusteredSize = 0;
+    if (numLists <= 1) {
+        return;
+    }
+
+    random_device rd;
+    mt19937 gen(rd());
+    vector<int> order(n);
+    for (int i = 0; i < n; i++) {
+        order[i] = i;
+    }
+    shuffle(order.begin(), order.end(), gen);
+
+    centroids.resize((size_t)numLists * dim);
+    for (int c = 0; c < numLists; c++) {
+        copy(vectors.begin() + (size_t)order[c] * dim, vectors.begin() + (size_t)(order[c] + 1) * dim,
+             centroids.begin() + (size_t)c * dim);
+    }
+
+    vector<int> assignment(n, 0);
+    for (int iteration = 0; iteration < iterations; iteration++) {
+        assignToCentroids(0, n, assignment);
+
+        Eigen::Map<RowMatrixXf> centroidMap(centroids.data(), numLists, dim);
+        centroidMap.setZero();
+        for (int i = 0; i < n; i++) {
+            centroidMap.row(assignment[i]) += vectorMatrix().row(i);
+        }
+        for (int c = 0; c < numLists; c++) {
+            float norm = centroidMap.row(c).norm();
+            if (norm > 0.0f) {
+                centroidMap.row(c) /= norm;
+            } else {
+                centroidMap.row(c) = vectorMatrix().row(order[c]);
+            }
+        }
+    }
+
+    lists.assign(numLists, vector<int>());
+    assignToCentroids(0, n, assignment);
+    for (int i = 0; i < n; i++) {
+        lists[assignment[i]].push_back(i);
+    }
+    clusteredSize = n;
+}
+
+void SentenceIndex::assignToCentroids(int first, int last, vector<int>& assignment) const {
+    const int chunkRows = 4096;
+    assignment.resize(last - first);
+
+    Eigen::MatrixXf scores;
+    for (int start = first; start < last; start += chunkRows) {
+        int rows = min(chunkRows, last - start);
+        scores.noalias() = centroidMatrix() * vectorMatrix().middleRows(start, rows).transpose();
+        for (int i = 0; i < rows; i++) {
+            Eigen::Index best = 0;
+            scores.col(i).maxCoeff(&best);
+            assignment[start - first + i] = (int)best;
+        }
+    }
+}
+
+uint64_t SentenceIndex::currentFingerprint() const {
+    uint64_t hash = neuralNetwork->getFingerprint();
+    hash ^= tokenizer->getFingerprint();
+    hash *= 1099511628211ull;
+    return hash;
+}
+
+vector<pair<int, float>> SentenceIndex::search(const string& query, int k, int numProbes) const {
+    return search(embed(query), k, numProbes);
+}
+
+vector<pair<int, float>> SentenceIndex::search(const Eigen::VectorXf& query, int k, int numProbes) const {
+    vector<pair<int, float>> scored;
+    if (size() == 0 || k <= 0 || query.size() != dim) {
+        return scored;
+    }
+
+    if (lists.empty()) {
+        Eigen::VectorXf scores = vectorMatrix() * query;
+        scored.reserve(scores.size());
+        for (int i = 0; i < scores.size(); i++) {
+            scored.emplace_back(i, scores[i]);
+        }
+        return selectTopK(scored, k);
+    }
+
+    Eigen::VectorXf centroidScores = centroidMatrix() * query;
+    vector<pair<int, float>> probes;
+    for (int c = 0; c < centroidScores.size(); c++) {
+        probes.emplace_back(c, centroidScores[c]);
+    }
+    probes = selectTopK(probes, max(numProbes, 1));
+
+    auto matrix = vectorMatrix();
+    for (const auto& probe : probes) {
+        for (int id : lists[probe.first]) {
+            scored.emplace_back(id, matrix.row(id).dot(query));
+        }
+    }
+    return selectTopK(scored, k);
+}
+
+Eigen::VectorXf SentenceIndex::embed(const string& text) const {
+    Eigen::VectorXf embedding = neuralNetwork->pooledEmbedding(tokenizer->tokenize(text)).cast<float>();
+    float norm = embedding.norm();
+    if (norm > 0.0f) {
+        embedding /= norm;
+    }
+    return embedding;
+}
+
+const string& SentenceIndex::getSentence(int id) const {
+    return sentences[id];
+}
+
+int SentenceIndex::size() const {
+    return (int)sentences.size();
+}
+
+void SentenceIndex::saveIndex(const string& filename) const {
+    ofstream file(filename, ios::binary);
+    if (!file.is_open()) {
+        cout << "Error: Could not open file for saving index." << endl;
+        return;
+    }
+
+    int count = size();
+    int numLists = (int)lists.size();
+    file.write(reinterpret_cast<const char*>(&count), sizeof(count));
+    file.write(reinterpret_cast<const char*>(&dim), sizeof(dim));
+    file.write(reinterpret_cast<const char*>(&numLists), sizeof(numLists));
+    file.write(reinterpret_cast<const char*>(&clusteredSize), sizeof(clusteredSize));
+    file.write(reinterpret_cast<const char*>(&modelFingerprint), sizeof(modelFingerprint));
+
+    file.write(reinterpret_cast<const char*>(vectors.data()), sizeof(float) * vectors.size());
+    file.write(reinterpret_cast<const char*>(centroids.data()), sizeof(float) * centroids.size());
+
+    for (const auto& list : lists) {
+        int listSize = (int)list.size();
+        file.write(reinterpret_cast<const char*>(&listSize), sizeof(listSize));
+        file.write(reinterpret_cast<const char*>(list.data()), sizeof(int) * listSize);
+    }
+
+    for (const string& sentence : sentences) {
+        int length = (int)sentence.size();
+        file.write(reinterpret_cast<const char*>(&length), sizeof(length));
+        file.write(sentence.data(), length);
+    }
+
+    file.close();
+}
+
+void SentenceIndex::loadIndex(const string& filename) {
+    ifstream file(filename, ios::binary);
+    if (!file.is_open()) {
+        cout << "Error: Could not open file for loading index." << endl;
+        return;
+    }
+
+    int count = 0;
+    int numLists = 0;
+    uint64_t fingerprint = 0;
+    clear();
+    file.read(reinterpret_cast<char*>(&count), sizeof(count));
+    file.read(reinterpret_cast<char*>(&dim), sizeof(dim));
+    file.read(reinterpret_cast<char*>(&numLists), sizeof(numLists));
+    file.read(reinterpret_cast<char*>(&clusteredSize), sizeof(clusteredSize));
+    file.read(reinterpret_cast<char*>(&fingerprint), sizeof(fingerprint));
+
+    if (fingerprint != currentFingerprint()) {
+        cout << "Error: Index was built for a different model." << endl;
+        clear();
+        dim = neuralNetwork->getEmbeddingDim();
+        return;
+    }
+    modelFingerprint = fingerprint;
+
+    vectors.resize((size_t)count * dim);
+    centroids.resize((size_t)numLists * dim);
+    file.read(reinterpret_cast<char*>(vectors.data()), sizeof(float) * vectors.size());
+    file.read(reinterpret_cast<char*>(centroids.data()), sizeof(float) * centroids.size());
+
+    lists.assign(numLists, vector<int>());
+    for (auto& list : lists) {
+        int listSize = 0;
+        file.read(reinterpret_cast<char*>(&listSize), sizeof(listSize));
+        list.resize(listSize);
+        file.read(reinterpret_cast<char*>(list.data()), sizeof(int) * listSize);
+    }
+
+    sentences.assign(count, string());
+    for (string& sentence : sentences) {
+        int length = 0;
+        file.read(reinterpret_cast<char*>(&length), sizeof(length));
+        sentence.resize(length);
+        file.read(&sentence[0], length);
+    }
+
+    file.close();
+
+    if (dim != neuralNetwork->getEmbeddingDim()) {
+        cout << "Warning: Index embedding size does not match the model." << endl;
+    }
+}
+
+Eigen::Map<const SentenceIndex::RowMatrixXf> SentenceIndex::vectorMatrix() const {
+    return Eigen::Map<const RowMatrixXf>(vectors.data(), size(), dim);
+}
+
+Eigen::Map<const SentenceIndex::RowMatrixXf> SentenceIndex::centroidMatrix() const {
+    return Eigen::Map<const RowMatrixXf>(centroids.data(), centroids.size() / max(dim, 1), dim);
+}
+
+vector<pair<int, float>> SentenceIndex::selectTopK(vector<pair<int, float>>& scored, int k) const {
+    auto byScore = [](const pair<int, float>& a, const pair<int, float>& b) {
+        return a.second > b.second;
+    };
+
+    if ((int)scored.size() > k) {
+        nth_element(scored.begin(), scored.begin() + k, scored.end(), byScore);
+        scored.resize(k);
+    }
+    sort(scored.begin(), scored.end(), byScore);
+    return scored;
+}
@@ -0,0 +1,201 @@
+#include "token_cache.h"
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+TokenCache::TokenCache()
+    : mapping(nullptr), mappingSize(0), header(nullptr), offsets(nullptr), tokens(nullptr), vocabulary(nullptr) {
+}
+
+TokenCache::~TokenCache() {
+    close();
+}
+
+bool TokenCache::build(const string& filename, const vector<string>& texts, Tokenizer* tokenizer) {
+    ofstream file(filename, ios::binary);
+    if (!file.is_open()) {
+        cout << "Error: Could not open file for writing token cache." << endl;
+        return false;
+    }
+
+    Header header = {};
+    memcpy(header.magic, "LTKC", 4);
+    header.version = 2;
+    header.idWidth = tokenizer->getVocabSize() <= 65536 ? 2 : 4;
+    header.tokenizerKind = (uint32_t)tokenizer->getKind();
+    header.fingerprint = tokenizer->getFingerprint();
+    header.documentCount = texts.size();
+
+    vector<uint64_t> offsets(texts.size() + 1, 0);
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    file.write(reinterpret_cast<const char*>(offsets.data()), sizeof(uint64_t) * offsets.size());
+
+    vector<uint16_t> narrowIds;
+    vector<uint32_t> wideIds;
+    for (size_t i = 0; i < texts.size(); i++) {
+        vector<int> document = tokenizer->tokenize(texts[i]);
+        offsets[i + 1] = offsets[i] + document.size();
+
+        if (header.idWidth == 2) {
+            narrowIds.assign(document.begin(), document.end());
+            file.write(reinterpret_cast<const char*>(narrowIds.data()), sizeof(uint16_t) * narrowIds.size());
+        } else {
+            wideIds.assign(document.begin(), document.end());
+            file.write(reinterpret_cast<const char*>(wideIds.data()), sizeof(uint32_t) * wideIds.size());
+        }
+    }
+
+    header.tokenCount = offsets.back();
+    streampos vocabularyStart = file.tellp();
+    tokenizer->saveVocabulary(file);
+    header.vocabularyBytes = (uint64_t)(file.tellp() - vocabularyStart);
+
+    file.seekp(0);
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    file.write(reinterpret_cast<const char*>(offsets.data()), sizeof(uint64_t) * offsets.size());
+
+    file.close();
+    return true;
+}
+
+bool TokenCache::open(const string& filename) {
+    close();
+
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        cout << "Error: Could not open token cache." << endl;
+        return false;
+    }
+
+    struct stat info;
+    if (fstat(fd, &info) != 0 || (size_t)info.st_size < sizeof(Header)) {
+        cout << "Error: Token cache is truncated." << endl;
+        ::close(fd);
+        return false;
+    }
+
+    void* data = mmap(nullptr, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (data == MAP_FAILED) {
+        cout << "Error: Could not map token cache." << endl;
+        return false;
+    }
+
+    mapping = data;
+    mappingSize = info.st_size;
+    header = static_cast<const Header*>(mapping);
+
+    if (memcmp(header->magic, "LTKC", 4) != 0 || header->version != 2 ||
+        (header->idWidth != 2 && header->idWidth != 4) ||
+        header->documentCount > (mappingSize - sizeof(Header)) / sizeof(uint64_t) ||
+        header->tokenCount > mappingSize / header->idWidth) {
+        cout << "Error: Not a valid token cache." << endl;
+        close();
+        return false;
+    }
+
+    size_t expectedSize = sizeof(Header) + sizeof(uint64_t) * (header->documentCount + 1) +
+                          (size_t)header->idWidth * header->tokenCount;
+    if (mappingSize < expectedSize || mappingSize - expectedSize < header->vocabularyBytes) {
+        cout << "Error: Token cache is truncated." << endl;
+        close();
+        return false;
+    }
+
+    offsets = reinterpret_cast<const uint64_t*>(static_cast<const unsigned char*>(mapping) + sizeof(Header));
+    tokens = reinterpret_cast<const unsigned char*>(offsets + header->documentCount + 1);
+    vocabulary = reinterpret_cast<const char*>(tokens + (size_t)header->idWidth * header->tokenCount);
+
+    if (offsets[0] != 0 || offsets[header->documentCount] != header->tokenCount) {
+        cout << "Error: Token cache offsets are corrupt." << endl;
+        close();
+        return false;
+    }
+    for (uint64_t i = 0; i < header->documentCount; i++) {
+        if (offsets[i + 1] < offsets[i]) {
+            cout << "Error: Token cache offsets are corrupt." << endl;
+            close();
+            return false;
+        }
+    }
+    madvise(mapping, mappingSize, MADV_SEQUENTIAL);
+    return true;
+}
+
+void TokenCache::close() {
+    if (mapping != nullptr) {
+        munmap(mapping, mappingSize);
+    }
+    mapping = nullptr;
+    mappingSize = 0;
+    header = nullptr;
+    offsets = nullptr;
+    tokens = nullptr;
+    vocabulary = nullptr;
+}
+
+bool TokenCache::isOpen() const {
+    return mapping != nullptr;
+}
+
+uint64_t TokenCache::getFingerprint() const {
+    return header != nullptr ? header->fingerprint : 0;
+}
+
+TokenizerKind TokenCache::getTokenizerKind() const {
+    return header != nullptr ? (TokenizerKind)header->tokenizerKind : TokenizerKind::Word;
+}
+
+bool TokenCache::loadTokenizer(Tokenizer* tokenizer) const {
+    if (header == nullptr) {
+        cout << "Error: Token cache is not open." << endl;
+        return false;
+    }
+
+    if (getTokenizerKind() != tokenizer->getKind()) {
+        cout << "Error: Token cache was built with a different tokenizer type." << endl;
+        return false;
+    }
+
+    istringstream in(string(vocabulary, header->vocabularyBytes));
+    if (!tokenizer->loadVocabulary(in) || tokenizer->getFingerprint() != header->fingerprint) {
+        cout << "Error: Token cache vocabulary is corrupt." << endl;
+        return false;
+    }
+    return true;
+}
+
+int TokenCache::getDocumentCount() const {
+    return header != nullptr ? (int)header->documentCount : 0;
+}
+
+size_t TokenCache::getTokenCount() const {
+    return header != nullptr ? header->tokenCount : 0;
+}
+
+vector<int> TokenCache::getDocument(int index) const {
+    vector<int> document;
+    if (header == nullptr || index < 0 || index >= getDocumentCount()) {
+        return document;
+    }
+
+    uint64_t begin = offsets[index];
+    uint64_t end = offsets[index + 1];
+    document.reserve(end - begin);
+
+    if (header->idWidth == 2) {
+        const uint16_t* ids = reinterpret_cast<const uint16_t*>(tokens);
+        document.assign(ids + begin, ids + end);
+    } else {
+        const uint32_t* ids = reinterpret_cast<const uint32_t*>(tokens);
+        document.assign(ids + begin, ids + end);
+    }
+    return document;
+}
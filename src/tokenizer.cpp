@@ -47,12 +47,11 @@ vector<int> Tokenizer::tokenize(const string& text) {
     vector<string> words = splitWords(text);
     vector<int> tokens;
 
+    int unknownId = vocabToId.at("<UNK>");
+
     for (const string& word : words) {
-        if (vocabToId.find(word) != vocabToId.end()) {
-            tokens.push_back(vocabToId[word]);
-        } else {
-            tokens.push_back(vocabToId["<UNK>"]);
-        }
+        auto it = vocabToId.find(word);
+        tokens.push_back(it != vocabToId.end() ? it->second : unknownId);
     }
 
     return tokens;
@@ -61,16 +60,25 @@ vector<int> Tokenizer::tokenize(const string& text) {
 string Tokenizer::detokenize(const vector<int>& tokens) {
     string result;
     for (int i = 0; i < tokens.size(); i++) {
-        if (idToVocab.find(tokens[i]) != idToVocab.end()) {
+        auto it = idToVocab.find(tokens[i]);
+        if (it != idToVocab.end()) {
             if (i > 0) result += " ";
-            result += idToVocab[tokens[i]];
+            result += it->second;
         }
     }
     return result;
 }
 
+string Tokenizer::getTokenText(int tokenId, bool startOfText) const {
+    auto it = idToVocab.find(tokenId);
+    if (it == idToVocab.end()) {
+        return "";
+    }
+    return startOfText ? it->second : " " + it->second;
+}
+
 int Tokenizer::getVocabSize() const {
-    return vocabToId.size();
+    return nextTokenId;
 }
 
 int Tokenizer::getTokenId(const string& token) const {
@@ -83,6 +91,64 @@ string Tokenizer::getToken(int tokenId) const {
     return (it != idToVocab.end()) ? it->second : "<UNK>";
 }
 
+TokenizerKind Tokenizer::getKind() const {
+    return TokenizerKind::Word;
+}
+
+void Tokenizer::saveVocabulary(ostream& out) const {
+    out.write(reinterpret_cast<const char*>(&nextTokenId), sizeof(nextTokenId));
+    for (int id = 0; id < nextTokenId; id++) {
+        auto it = idToVocab.find(id);
+        const string token = (it != idToVocab.end()) ? it->second : string();
+        int length = (int)token.size();
+        out.write(reinterpret_cast<const char*>(&length), sizeof(length));
+        out.write(token.data(), length);
+    }
+}
+
+bool Tokenizer::loadVocabulary(istream& in) {
+    int count = 0;
+    in.read(reinterpret_cast<char*>(&count), sizeof(count));
+    if (!in || count < 0) {
+        return false;
+    }
+
+    unordered_map<string, int> loadedVocabToId;
+    unordered_map<int, string> loadedIdToVocab;
+    for (int id = 0; id < count; id++) {
+        int length = 0;
+        in.read(reinterpret_cast<char*>(&length), sizeof(length));
+        if (!in || length < 0) {
+            return false;
+        }
+        string token(length, '\0');
+        in.read(&token[0], length);
+        loadedIdToVocab[id] = token;
+        loadedVocabToId.emplace(token, id);
+    }
+    if (!in || loadedVocabToId.find("<UNK>") == loadedVocabToId.end()) {
+        return false;
+    }
+
+    vocabToId.swap(loadedVocabToId);
+    idToVocab.swap(loadedIdToVocab);
+    nextTokenId = count;
+    return true;
+}
+
+uint64_t Tokenizer::getFingerprint() const {
+    uint64_t hash = 1469598103934665603ull;
+    for (int id = 0; id < nextTokenId; id++) {
+        auto it = idToVocab.find(id);
+        const string token = (it != idToVocab.end()) ? it->second : string();
+        for (unsigned char c : token) {
+            hash = (hash ^ c) * 1099511628211ull;
+        }
+        hash = (hash ^ 0xff) * 1099511628211ull;
+    }
+    return hash;
+}
+
 vector<string> Tokenizer::splitWords(const string& text) {
     vector<string> words;
     istringstream iss(text);
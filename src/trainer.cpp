@@ -2,11 +2,19 @@
 #include <iostream>
 #include <algorithm>
 #include <random>
+#include <thread>
+#include <chrono>
+#include <cmath>
+#include <limits>
+#include <unordered_map>
 
 using namespace std;
 
 Trainer::Trainer(NeuralNetwork* network, Tokenizer* tokenizer)
-    : neuralNetwork(network), tokenizer(tokenizer), contextLength(32) {
+    : neuralNetwork(network), tokenizer(tokenizer), contextLength(network->getContextLength()), validationSplit(0.0),
+      evaluationInterval(0), earlyStoppingPatience(0), deduplicateSamples(false), maxSampleWeight(1.0),
+      bestValidationLoss(0.0),
+      evaluationsWithoutImprovement(0), prefetchThreads(1), prefetchDepth(4) {
 }
 
 Trainer::~Trainer() {
@@ -14,49 +22,130 @@ Trainer::~Trainer() {
 
 void Trainer::trainOnText(const vector<string>& texts, int epochs, double learningRate) {
     auto trainingPairs = createTrainingPairs(texts);
+    trainOnSamples(trainingPairs, epochs, learningRate);
+}
 
+void Trainer::trainOnCorpus(const TokenCache& corpus, int epochs, double learningRate) {
+    if (!checkCorpus(corpus)) {
+        return;
+    }
+
+    auto trainingPairs = createTrainingPairs(corpus);
+    trainOnSamples(trainingPairs, epochs, learningRate);
+}
+
+void Trainer::trainOnSamples(vector<TrainingSample>& trainingPairs, int epochs, double learningRate) {
     if (trainingPairs.empty()) {
         cout << "No training data available!" << endl;
         return;
     }
 
+    auto validationPairs = holdOutValidationData(trainingPairs);
+    bestValidationLoss = numeric_limits<double>::infinity();
+    evaluationsWithoutImprovement = 0;
+    bestCheckpoint = NeuralNetwork::Checkpoint();
+    bool stopTraining = false;
+
     cout << "Training on " << trainingPairs.size() << " samples for " << epochs << " epochs..." << endl;
+    if (!validationPairs.empty()) {
+        cout << "Holding out " << validationPairs.size() << " samples for validation." << endl;
+    }
 
+    int batchSize = min(32, (int)trainingPairs.size());
+    random_device rd;
+    unsigned seed = rd();
+    atomic<bool> stopProducers(false);
+    vector<unique_ptr<PrefetchChannel>> channels;
+    vector<unique_ptr<EpochPlan>> plans;
+    vector<thread> producers;
+    for (int p = 0; p < prefetchThreads; p++) {
+        channels.push_back(make_unique<PrefetchChannel>(prefetchDepth));
+    }
     for (int epoch = 0; epoch < epochs; epoch++) {
-        shuffleTrainingData(trainingPairs);
+        plans.push_back(make_unique<EpochPlan>());
+    }
+    for (int p = 0; p < prefetchThreads; p++) {
+        producers.emplace_back(&Trainer::produceBatches, this, cref(trainingPairs), ref(plans), batchSize, seed, p,
+                               ref(*channels[p]), cref(stopProducers));
+    }
 
+    pipelineStats = PipelineStats();
+    long long sequence = 0;
+    vector<int> target;
+
+    for (int epoch = 0; epoch < epochs && !stopTraining; epoch++) {
         double totalLoss = 0.0;
-        int batchSize = min(32, (int)trainingPairs.size());
+        double totalWeight = 0.0;
+        bool epochDone = false;
+
+        while (!epochDone && !stopTraining) {
+            PrefetchChannel& channel = *channels[sequence % prefetchThreads];
+            TrainingBatch* batch = nextBatch(channel);
+            sequence++;
+            int length = batch->contextLength;
+            for (int j = 0; j < batch->size; j++) {
+                double weight = batch->weights[j];
+                target.assign(batch->targets.begin() + batch->targetOffsets[j],
+                              batch->targets.begin() + batch->targetOffsets[j + 1]);
+
+                neuralNetwork->forwardLogits(batch->contexts.data() + j * length, length, forwardState);
+                totalLoss += weight * neuralNetwork->softmaxCrossEntropy(forwardState, target, weight);
+                totalWeight += weight;
+
+                if (neuralNetwork->usesFusedUpdates()) {
+                    neuralNetwork->backwardAndUpdate(forwardState, learningRate);
+                } else {
+                    neuralNetwork->backward(forwardState);
+                }
+            }
 
-        for (int i = 0; i < trainingPairs.size(); i += batchSize) {
-            for (int j = i; j < min(i + batchSize, (int)trainingPairs.size()); j++) {
-                const auto& pair = trainingPairs[j];
-                const vector<int>& input = pair.first;
-                const vector<int>& target = pair.second;
+            neuralNetwork->updateWeights(learningRate);
 
-                auto prediction = neuralNetwork->forward(input);
-                neuralNetwork->backward(prediction, target);
+            int b = batch->index;
+            epochDone = batch->lastInEpoch;
+            channel.free.push(batch);
+            pipelineStats.batches++;
 
-                double loss = 0.0;
-                for (int k = 0; k < target.size() && k < prediction.size(); k++) {
-                    if (target[k] < prediction.size()) {
-                        loss -= log(max(prediction[target[k]], 1e-15));
-                    }
-                }
-                totalLoss += loss / target.size();
+            if (!validationPairs.empty() && evaluationInterval > 0 && (b + 1) % evaluationInterval == 0) {
+                stopTraining = recordValidationLoss(evaluateLoss(validationPairs));
             }
+        }
 
-            neuralNetwork->updateWeights(learningRate);
+        double avgLoss = totalLoss / totalWeight;
+        cout << "Epoch " << (epoch + 1) << "/" << epochs << " - Loss: " << avgLoss;
+
+        if (!validationPairs.empty() && evaluationInterval <= 0) {
+            double validationLoss = evaluateLoss(validationPairs);
+            cout << " - Validation loss: " << validationLoss;
+            stopTraining = recordValidationLoss(validationLoss);
+        } else if (!validationPairs.empty()) {
+            cout << " - Best validation loss: " << bestValidationLoss;
         }
+        cout << endl;
 
-        double avgLoss = totalLoss / trainingPairs.size();
-        cout << "Epoch " << (epoch + 1) << "/" << epochs << " - Loss: " << avgLoss << endl;
+        if (stopTraining) {
+            cout << "Validation loss stopped improving; stopping early." << endl;
+        }
 
         if (epoch > 0 && epoch % 5 == 0) {
             learningRate *= 0.95;
         }
     }
 
+    stopProducers = true;
+    for (int p = 0; p < prefetchThreads; p++) {
+        producers[p].join();
+        pipelineStats.producerWaitSeconds += channels[p]->waitSeconds;
+    }
+    cout << "Data pipeline: trainer waited " << pipelineStats.trainerWaitSeconds * 1000.0 << " ms for batches, "
+         << "producers waited " << pipelineStats.producerWaitSeconds * 1000.0 << " ms for free buffers." << endl;
+
+    if (bestCheckpoint.vocabSize > 0) {
+        neuralNetwork->restoreCheckpoint(bestCheckpoint);
+        bestCheckpoint = NeuralNetwork::Checkpoint();
+        cout << "Restored the weights with the best validation loss (" << bestValidationLoss << ")." << endl;
+    }
+
     cout << "Training completed!" << endl;
 }
 
@@ -67,78 +156,373 @@ double Trainer::calculateLoss(const vector<string>& texts) {
         return 0.0;
     }
 
-    double totalLoss = 0.0;
+    return evaluateLoss(trainingPairs);
+}
 
-    for (const auto& pair : trainingPairs) {
-        const vector<int>& input = pair.first;
-        const vector<int>& target = pair.second;
+double Trainer::calculateLoss(const TokenCache& corpus) {
+    if (!checkCorpus(corpus)) {
+        return 0.0;
+    }
 
-        auto prediction = neuralNetwork->forward(input);
+    auto trainingPairs = createTrainingPairs(corpus);
 
-        double loss = 0.0;
-        for (int i = 0; i < target.size() && i < prediction.size(); i++) {
-            if (target[i] < prediction.size()) {
-                loss -= log(max(prediction[target[i]], 1e-15));
-            }
-        }
-        totalLoss += loss / target.size();
+    if (trainingPairs.empty()) {
+        return 0.0;
     }
 
-    return totalLoss / trainingPairs.size();
+    return evaluateLoss(trainingPairs);
 }
 
 void Trainer::setContextLength(int length) {
     contextLength = length;
 }
 
-vector<pair<vector<int>, vector<int>>> Trainer::createTrainingPairs(const vector<string>& texts) {
-    vector<pair<vector<int>, vector<int>>> trainingPairs;
+void Trainer::setValidationSplit(double fraction) {
+    validationSplit = max(0.0, min(fraction, 0.5));
+}
+
+void Trainer::setEvaluationInterval(int batches) {
+    evaluationInterval = batches;
+}
+
+void Trainer::setEarlyStopping(int patience) {
+    earlyStoppingPatience = patience;
+}
+
+void Trainer::setDeduplicateSamples(bool enabled) {
+    deduplicateSamples = enabled;
+}
+
+void Trainer::setMaxSampleWeight(double weight) {
+    maxSampleWeight = weight;
+}
+
+void Trainer::setFusedUpdates(bool enabled) {
+    neuralNetwork->setFusedUpdates(enabled);
+}
+
+void Trainer::setPrefetchThreads(int threads) {
+    prefetchThreads = max(1, threads);
+}
+
+void Trainer::setPrefetchDepth(int batches) {
+    prefetchDepth = max(1, batches);
+}
+
+PipelineStats Trainer::getPipelineStats() const {
+    return pipelineStats;
+}
+
+vector<TrainingSample> Trainer::createTrainingPairs(const vector<string>& texts) {
+    vector<TrainingSample> trainingPairs;
 
     for (const string& text : texts) {
-        vector<int> tokens = tokenizer->tokenize(text);
+        appendTrainingPairs(tokenizer->tokenize(text), trainingPairs);
+    }
 
-        if (tokens.size() < 2) continue;
+    if (deduplicateSamples) {
+        mergeDuplicateSamples(trainingPairs);
+    }
+
+    return trainingPairs;
+}
+
+vector<TrainingSample> Trainer::createTrainingPairs(const TokenCache& corpus) {
+    vector<TrainingSample> trainingPairs;
+
+    for (int i = 0; i < corpus.getDocumentCount(); i++) {
+        appendTrainingPairs(corpus.getDocument(i), trainingPairs);
+    }
+
+    if (deduplicateSamples) {
+        mergeDuplicateSamples(trainingPairs);
+    }
 
-        for (int i = 0; i <= (int)tokens.size() - contextLength - 1; i++) {
+    return trainingPairs;
+}
+
+void Trainer::appendTrainingPairs(const vector<int>& tokens, vector<TrainingSample>& trainingPairs) {
+    if (tokens.size() < 2) return;
+
+    for (int i = 0; i <= (int)tokens.size() - contextLength - 1; i++) {
+        vector<int> context;
+        vector<int> target;
+
+        for (int j = 0; j < contextLength && i + j < tokens.size(); j++) {
+            context.push_back(tokens[i + j]);
+        }
+
+        if (i + contextLength < tokens.size()) {
+            target.push_back(tokens[i + contextLength]);
+        }
+
+        if (!context.empty() && !target.empty()) {
+            trainingPairs.push_back({context, target, 1.0});
+        }
+    }
+
+    for (int windowSize = 3; windowSize <= min(10, (int)tokens.size()); windowSize++) {
+        for (int i = 0; i <= (int)tokens.size() - windowSize; i++) {
             vector<int> context;
             vector<int> target;
 
-            for (int j = 0; j < contextLength && i + j < tokens.size(); j++) {
+            for (int j = 0; j < windowSize - 1; j++) {
                 context.push_back(tokens[i + j]);
             }
 
-            if (i + contextLength < tokens.size()) {
-                target.push_back(tokens[i + contextLength]);
-            }
+            target.push_back(tokens[i + windowSize - 1]);
 
             if (!context.empty() && !target.empty()) {
-                trainingPairs.emplace_back(context, target);
+                trainingPairs.push_back({context, target, 1.0});
             }
         }
+    }
+}
 
-        for (int windowSize = 3; windowSize <= min(10, (int)tokens.size()); windowSize++) {
-            for (int i = 0; i <= (int)tokens.size() - windowSize; i++) {
-                vector<int> context;
-                vector<int> target;
+bool Trainer::checkCorpus(const TokenCache& corpus) const {
+    if (!corpus.isOpen()) {
+        cout << "Error: Token cache is not open." << endl;
+        return false;
+    }
 
-                for (int j = 0; j < windowSize - 1; j++) {
-                    context.push_back(tokens[i + j]);
-                }
+    if (corpus.getFingerprint() != tokenizer->getFingerprint()) {
+        cout << "Error: Token cache was built with a different vocabulary." << endl;
+        return false;
+    }
 
-                target.push_back(tokens[i + windowSize - 1]);
+    return true;
+}
 
-                if (!context.empty() && !target.empty()) {
-                    trainingPairs.emplace_back(context, target);
+struct TokenSequenceHash {
+    size_t operator()(const vector<int>& tokens) const {
+        size_t hash = 1469598103934665603ull;
+        for (int token : tokens) {
+            hash ^= (size_t)(unsigned)token;
+            hash *= 1099511628211ull;
+        }
+        return hash;
+    }
+};
+
+void Trainer::mergeDuplicateSamples(vector<TrainingSample>& samples) {
+    unordered_map<vector<int>, int, TokenSequenceHash> sampleIndex;
+    sampleIndex.reserve(samples.size());
+
+    size_t unique = 0;
+    vector<int> key;
+    for (size_t i = 0; i < samples.size(); i++) {
+        key.assign(samples[i].context.begin(), samples[i].context.end());
+        key.push_back(-1);
+        key.insert(key.end(), samples[i].target.begin(), samples[i].target.end());
+
+        auto inserted = sampleIndex.emplace(key, (int)unique);
+        if (inserted.second) {
+            if (unique != i) {
+                samples[unique] = move(samples[i]);
+            }
+            unique++;
+        } else {
+            samples[inserted.first->second].weight += samples[i].weight;
+        }
+    }
+
+    samples.resize(unique);
+}
+
+Trainer::PrefetchChannel::PrefetchChannel(int depth)
+    : ready(depth), free(depth), buffers(depth), waitSeconds(0.0) {
+    for (TrainingBatch& buffer : buffers) {
+        free.push(&buffer);
+    }
+}
+
+void Trainer::produceBatches(const vector<TrainingSample>& data, vector<unique_ptr<EpochPlan>>& plans, int batchSize,
+                             unsigned seed, int producerIndex, PrefetchChannel& channel, const atomic<bool>& stop) const {
+    long long sequence = 0;
+    for (int epoch = 0; epoch < (int)plans.size(); epoch++) {
+        EpochPlan& plan = *plans[epoch];
+        call_once(plan.built, [&]() {
+            mt19937 gen(seed + epoch);
+            plan.batches = createLengthBatches(data, plan.order, batchSize, gen);
+        });
+        const vector<int>& order = plan.order;
+        const vector<pair<int, int>>& batches = plan.batches;
+
+        for (int b = 0; b < (int)batches.size(); b++, sequence++) {
+            if (sequence % prefetchThreads != producerIndex) {
+                continue;
+            }
+
+            TrainingBatch* batch = nullptr;
+            if (!channel.free.pop(batch)) {
+                auto waitStart = chrono::steady_clock::now();
+                for (int spins = 0; !channel.free.pop(batch); spins++) {
+                    if (stop) {
+                        return;
+                    }
+                    if (spins < 64) {
+                        this_thread::yield();
+                    } else {
+                        this_thread::sleep_for(chrono::microseconds(100));
+                    }
                 }
+                channel.waitSeconds += chrono::duration<double>(chrono::steady_clock::now() - waitStart).count();
             }
+
+            batch->epoch = epoch;
+            batch->index = b;
+            batch->lastInEpoch = b + 1 == (int)batches.size();
+            packBatch(data, order.data() + batches[b].first, batches[b].second - batches[b].first, *batch);
+            channel.ready.push(batch);
+        }
+
+        if (++plan.finishedProducers == prefetchThreads) {
+            vector<int>().swap(plan.order);
+            vector<pair<int, int>>().swap(plan.batches);
         }
     }
+}
 
-    return trainingPairs;
+int Trainer::sampleCopies(const TrainingSample& sample) const {
+    if (maxSampleWeight <= 0.0 || sample.weight <= maxSampleWeight) {
+        return 1;
+    }
+    return (int)ceil(sample.weight / maxSampleWeight);
+}
+
+void Trainer::packBatch(const vector<TrainingSample>& data, const int* indices, int count, TrainingBatch& batch) const {
+    int length = (int)data[indices[0]].context.size();
+    batch.contextLength = length;
+    batch.size = count;
+    batch.contexts.resize((size_t)count * length);
+    batch.targets.clear();
+    batch.targetOffsets.assign(1, 0);
+    batch.weights.resize(count);
+
+    for (int i = 0; i < count; i++) {
+        const TrainingSample& sample = data[indices[i]];
+        copy(sample.context.begin(), sample.context.end(), batch.contexts.begin() + (size_t)i * length);
+        batch.targets.insert(batch.targets.end(), sample.target.begin(), sample.target.end());
+        batch.targetOffsets.push_back((int)batch.targets.size());
+        batch.weights[i] = sample.weight / sampleCopies(sample);
+    }
 }
 
-void Trainer::shuffleTrainingData(vector<pair<vector<int>, vector<int>>>& data) {
+TrainingBatch* Trainer::nextBatch(PrefetchChannel& channel) {
+    TrainingBatch* batch = nullptr;
+    if (channel.ready.pop(batch)) {
+        return batch;
+    }
+
+    auto waitStart = chrono::steady_clock::now();
+    for (int spins = 0; !channel.ready.pop(batch); spins++) {
+        if (spins < 64) {
+            this_thread::yield();
+        } else {
+            this_thread::sleep_for(chrono::microseconds(100));
+        }
+    }
+    pipelineStats.trainerWaitSeconds += chrono::duration<double>(chrono::steady_clock::now() - waitStart).count();
+    return batch;
+}
+
+vector<pair<int, int>> Trainer::createLengthBatches(const vector<TrainingSample>& data, vector<int>& order, int batchSize,
+                                                    mt19937& gen) const {
+    order.clear();
+    for (int i = 0; i < (int)data.size(); i++) {
+        order.insert(order.end(), sampleCopies(data[i]), i);
+    }
+    shuffle(order.begin(), order.end(), gen);
+    stable_sort(order.begin(), order.end(), [&data](int a, int b) {
+        return data[a].context.size() < data[b].context.size();
+    });
+
+    vector<pair<int, int>> batches;
+    int start = 0;
+    for (int i = 1; i <= (int)order.size(); i++) {
+        if (i == (int)order.size() || i - start == batchSize ||
+            data[order[i]].context.size() != data[order[start]].context.size()) {
+            batches.emplace_back(start, i);
+            start = i;
+        }
+    }
+
+    shuffle(batches.begin(), batches.end(), gen);
+    return batches;
+}
+
+void Trainer::shuffleTrainingData(vector<TrainingSample>& data) {
     random_device rd;
     mt19937 gen(rd());
     shuffle(data.begin(), data.end(), gen);
-}
\ No newline at end of file
+}
+
+vector<TrainingSample> Trainer::holdOutValidationData(vector<TrainingSample>& data) {
+    vector<TrainingSample> validation;
+    int validationSize = (int)(data.size() * validationSplit);
+    if (validationSize == 0 || validationSize >= (int)data.size()) {
+        return validation;
+    }
+
+    shuffleTrainingData(data);
+    validation.assign(make_move_iterator(data.end() - validationSize), make_move_iterator(data.end()));
+    data.resize(data.size() - validationSize);
+    return validation;
+}
+
+double Trainer::evaluateLoss(const vector<TrainingSample>& data) const {
+    if (data.empty()) {
+        return 0.0;
+    }
+
+    const int samplesPerThread = 256;
+    int numThreads = (int)max(1u, thread::hardware_concurrency());
+    numThreads = max(1, min(numThreads, (int)(data.size() + samplesPerThread - 1) / samplesPerThread));
+
+    vector<double> partialLosses(numThreads, 0.0);
+    vector<double> partialWeights(numThreads, 0.0);
+    auto evaluateRange = [&](int threadIndex) {
+        NeuralNetwork::ForwardState state;
+        size_t begin = data.size() * threadIndex / numThreads;
+        size_t end = data.size() * (threadIndex + 1) / numThreads;
+        double loss = 0.0;
+        double weight = 0.0;
+        for (size_t i = begin; i < end; i++) {
+            const vector<int>& input = data[i].context;
+            neuralNetwork->forwardLogits(input.data(), (int)input.size(), state);
+            loss += data[i].weight * neuralNetwork->crossEntropyLoss(state, data[i].target);
+            weight += data[i].weight;
+        }
+        partialLosses[threadIndex] = loss;
+        partialWeights[threadIndex] = weight;
+    };
+
+    vector<thread> workers;
+    for (int t = 1; t < numThreads; t++) {
+        workers.emplace_back(evaluateRange, t);
+    }
+    evaluateRange(0);
+    for (auto& worker : workers) {
+        worker.join();
+    }
+
+    double totalLoss = 0.0;
+    double totalWeight = 0.0;
+    for (int t = 0; t < numThreads; t++) {
+        totalLoss += partialLosses[t];
+        totalWeight += partialWeights[t];
+    }
+    return totalWeight > 0.0 ? totalLoss / totalWeight : 0.0;
+}
+
+bool Trainer::recordValidationLoss(double loss) {
+    if (loss < bestValidationLoss) {
+        bestValidationLoss = loss;
+        evaluationsWithoutImprovement = 0;
+        bestCheckpoint = neuralNetwork->createCheckpoint();
+        return false;
+    }
+
+    evaluationsWithoutImprovement++;
+    return earlyStoppingPatience > 0 && evaluationsWithoutImprovement >= earlyStoppingPatience;
+}